@@ -0,0 +1,254 @@
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "formats.h"
+#include "gpaint.h"
+#include "mipmap.h"
+#include "preview.h"
+#include "stroke.h"
+#include "tools/tools.h"
+#include "view.h"
+
+// Drives the tools, the history and the codecs against an offscreen canvas
+// and prints how many operations per second each sustains at several canvas
+// sizes, and how much the heap grew at most while they ran.
+//
+// Usage: gpaint-bench [SIZE...]
+
+#if defined (__GLIBC__) && __GLIBC_PREREQ (2, 33)
+# define HAVE_MALLINFO2 1
+#else
+# define HAVE_MALLINFO2 0
+#endif
+
+enum
+{
+  BENCH_MIN_OPS = 3,
+  BENCH_MAX_OPS = 1000,
+  BENCH_STROKE_POINTS = 64,
+  BENCH_HISTORY_STEPS = 16,
+  BENCH_CODEC_MAX_SIZE = 2048, // Saving larger canvases takes seconds
+};
+
+static const double bench_min_time = 0.3; // Seconds per case
+static const int default_sizes[] = { 256, 1024, 4096, 8192 };
+
+typedef struct
+{
+  const gchar *name;
+  const Tool *tool;
+  void (*run) (AppState *state, guint op);
+  int max_size; // 0 if unlimited
+  guint fill_tolerance;
+  gboolean fill_global;
+  guint symmetry_folds;
+  void (*setup) (AppState *state); // Runs before the timing starts, may be NULL
+} BenchCase;
+
+static gsize
+heap_in_use (void)
+{
+#if HAVE_MALLINFO2
+  return mallinfo2 ().uordblks;
+#else
+  return 0;
+#endif
+}
+
+// A zigzag across the canvas, different for every op.
+static void
+stroke_point (AppState *state, guint op, int i, gint *x, gint *y)
+{
+  const int size = cairo_image_surface_get_width (state->main_surface);
+
+  *x = (int) ((gint64) (i + 1) * size / (BENCH_STROKE_POINTS + 1));
+  *y = (i + op) % 2 ? size / 8 + (int) (op % 16) : size - size / 8 - (int) (op % 16);
+}
+
+static void
+run_stroke (AppState *state, guint op)
+{
+  gint x, y;
+
+  stroke_point (state, op, 0, &x, &y);
+  stroke_begin (state, x, y);
+
+  for (int i = 1; i < BENCH_STROKE_POINTS; i++)
+    {
+      stroke_point (state, op, i, &x, &y);
+      stroke_motion (state, x, y);
+    }
+
+  stroke_end (state);
+}
+
+// Fills the whole canvas, with alternating colors so the fill never finds
+// its target color already in place.
+static void
+run_fill (AppState *state, guint op)
+{
+  state->primary_color = op % 2 ? GPAINT_GDK_BLACK : (GdkRGBA) { 1.0, 0.0, 0.0, 1.0 };
+  stroke_begin (state, 0, 0);
+  stroke_end (state);
+}
+
+// Records a few brush strokes to step through.
+static void
+setup_history (AppState *state)
+{
+  for (guint i = 0; i < BENCH_HISTORY_STEPS; i++)
+    run_stroke (state, i);
+}
+
+static void
+run_undo (AppState *state, guint op)
+{
+  move_backward (&state->backup_manager, state);
+  move_forward (&state->backup_manager, state);
+}
+
+static void
+run_codec (AppState *state, guint op)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *path = g_build_filename (g_get_tmp_dir (), "gpaint-bench.png", NULL);
+  cairo_surface_t *surface = NULL;
+
+  if (!save_image (path, state->main_surface, 0, &error))
+    g_printerr ("Failed to save %s: %s\n", path, error ? error->message : "unknown error");
+
+  load_image (&surface, path);
+  g_clear_pointer (&surface, cairo_surface_destroy);
+  g_unlink (path);
+}
+
+static const BenchCase bench_cases[] = {
+  { "freehand", &global_freehand_tool, run_stroke },
+  { "brush", &global_brush_tool, run_stroke },
+  { "eraser", &global_eraser_tool, run_stroke },
+  { "symmetric freehand", &global_symmetric_freehand_tool, run_stroke },
+  { "symmetric 16-fold", &global_symmetric_freehand_tool, run_stroke, 0, 0, FALSE, 16 },
+  { "line", &global_line_tool, run_stroke },
+  { "rectangle", &global_rectangle_tool, run_stroke },
+  { "ellipse", &global_ellipse_tool, run_stroke },
+  { "triangle", &global_triangle_tool, run_stroke },
+  { "bucket", &global_bucket_tool, run_fill },
+  { "bucket tolerance", &global_bucket_tool, run_fill, 0, 16 },
+  { "bucket global", &global_bucket_tool, run_fill, 0, 0, TRUE },
+  { "undo+redo", &global_brush_tool, run_undo, .setup = setup_history },
+  { "png save+load", NULL, run_codec, BENCH_CODEC_MAX_SIZE },
+};
+
+static void
+init_state (AppState *state, int size)
+{
+  *state = (AppState) { 0 };
+  state->main_surface = create_surface (size, size);
+  state->p_color = &state->primary_color;
+  state->s_color = &state->secondary_color;
+  state->primary_color = GPAINT_GDK_BLACK;
+  state->secondary_color = GPAINT_GDK_TRANSPARENT;
+  state->zoom_level = 1.0;
+  state->width = 3.0;
+  state->brush_size = 8.0;
+  state->eraser_size = 8.0;
+  state->fill_type = FILL_PRIMARY;
+  state->antialiasing = CAIRO_ANTIALIAS_NONE;
+  state->tool = &global_freehand_tool;
+  init_backup_manager (&state->backup_manager, state->main_surface);
+}
+
+static void
+free_state (AppState *state)
+{
+  // Let the history worker's notifications run before the manager goes.
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+
+  free_backup_manager (&state->backup_manager);
+  free_preview (state);
+  free_view (state);
+  free_mipmap (state);
+  g_clear_pointer (&state->main_surface, cairo_surface_destroy);
+}
+
+static void
+run_case (const BenchCase *bench, int size)
+{
+  AppState state;
+  guint ops = 0;
+
+  init_state (&state, size);
+
+  if (bench->tool)
+    state.tool = bench->tool;
+
+  state.fill_tolerance = bench->fill_tolerance;
+  state.fill_global = bench->fill_global;
+  state.symmetry_folds = bench->symmetry_folds;
+
+  if (bench->setup)
+    bench->setup (&state);
+
+  const gsize heap = heap_in_use ();
+  gsize peak = heap;
+  const gint64 start = g_get_monotonic_time ();
+  gint64 elapsed;
+
+  do
+    {
+      bench->run (&state, ops++);
+      peak = MAX (peak, heap_in_use ());
+      elapsed = g_get_monotonic_time () - start;
+    }
+  while (ops < BENCH_MAX_OPS && (ops < BENCH_MIN_OPS || elapsed < bench_min_time * G_USEC_PER_SEC));
+
+  g_autofree gchar *grown = HAVE_MALLINFO2 ? g_format_size (peak - heap) : g_strdup ("-");
+
+  printf ("%-20s %5d %12.1f ops/s %12s\n", bench->name, size, ops * (double) G_USEC_PER_SEC / MAX (elapsed, 1), grown);
+  fflush (stdout);
+  free_state (&state);
+}
+
+int
+main (int argc, char **argv)
+{
+  GArray *sizes = g_array_new (FALSE, FALSE, sizeof (int));
+
+  for (int i = 1; i < argc; i++)
+    {
+      const int size = atoi (argv[i]);
+
+      if (size <= 0)
+        {
+          g_printerr ("Usage: %s [SIZE...]\n", argv[0]);
+          return EXIT_FAILURE;
+        }
+
+      g_array_append_val (sizes, size);
+    }
+
+  if (sizes->len == 0)
+    g_array_append_vals (sizes, default_sizes, countof (default_sizes));
+
+  printf ("%-20s %5s %18s %12s\n", "case", "size", "rate", "peak heap");
+
+  for (gsize i = 0; i < countof (bench_cases); i++)
+    for (guint j = 0; j < sizes->len; j++)
+      {
+        const int size = g_array_index (sizes, int, j);
+
+        if (!bench_cases[i].max_size || size <= bench_cases[i].max_size)
+          run_case (&bench_cases[i], size);
+      }
+
+  g_array_free (sizes, TRUE);
+  return EXIT_SUCCESS;
+}
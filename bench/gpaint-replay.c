@@ -0,0 +1,98 @@
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "formats.h"
+#include "gpaint.h"
+#include "mipmap.h"
+#include "preview.h"
+#include "trace.h"
+#include "tools/tools.h"
+#include "view.h"
+
+// Replays input traces recorded by running gpaint with GPAINT_TRACE set,
+// without a window, and prints how long the tools took to handle them.
+//
+// Usage: gpaint-replay [--paced] [--repeat N] [--output FILE.png] TRACE
+
+int
+main (int argc, char **argv)
+{
+  gboolean paced = FALSE;
+  gint repeat = 1;
+  gchar *output = NULL;
+  g_autoptr (GError) error = NULL;
+
+  const GOptionEntry entries[] = {
+    { "paced", 'p', 0, G_OPTION_ARG_NONE, &paced, "Wait between events as long as when recorded", NULL },
+    { "repeat", 'r', 0, G_OPTION_ARG_INT, &repeat, "Replay the trace N times", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Save the resulting canvas", "FILE" },
+    { NULL },
+  };
+
+  GOptionContext *context = g_option_context_new ("TRACE");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error) || argc != 2 || repeat < 1)
+    {
+      if (error)
+        g_printerr ("%s\n", error->message);
+
+      g_printerr ("%s", g_option_context_get_help (context, TRUE, NULL));
+      g_option_context_free (context);
+      return EXIT_FAILURE;
+    }
+
+  g_option_context_free (context);
+
+  AppState state = { 0 };
+  state.main_surface = create_surface (1, 1);
+  state.p_color = &state.primary_color;
+  state.s_color = &state.secondary_color;
+  state.zoom_level = 1.0;
+  state.tool = &global_freehand_tool;
+  init_backup_manager (&state.backup_manager, state.main_surface);
+
+  int status = EXIT_SUCCESS;
+
+  for (gint i = 0; i < repeat; i++)
+    {
+      TraceReplayStats stats;
+      const gint64 start = g_get_monotonic_time ();
+
+      if (!trace_replay (&state, argv[1], paced, &stats, &error))
+        {
+          g_printerr ("Failed to replay %s: %s\n", argv[1], error->message);
+          status = EXIT_FAILURE;
+          break;
+        }
+
+      const gint64 elapsed = g_get_monotonic_time () - start;
+
+      printf ("%u events, %u strokes (%u skipped): %.1f ms in tools, %.1f ms total, %.1f us per event\n",
+              stats.events, stats.strokes, stats.skipped, stats.busy / 1000.0, elapsed / 1000.0,
+              stats.events ? (double) stats.busy / stats.events : 0.0);
+    }
+
+  // Let the history worker's notifications run before the manager goes.
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+
+  if (status == EXIT_SUCCESS && output && !save_image (output, state.main_surface, 0, &error))
+    {
+      g_printerr ("Failed to save %s: %s\n", output, error ? error->message : "unknown error");
+      status = EXIT_FAILURE;
+    }
+
+  free_backup_manager (&state.backup_manager);
+  free_preview (&state);
+  free_view (&state);
+  free_mipmap (&state);
+  cairo_surface_destroy (state.main_surface);
+  g_free (output);
+  return status;
+}
@@ -1,6 +1,88 @@
 
 #include "backup.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The history is stored as tile deltas. The manager keeps one copy of the
+// canvas as it was after the last recorded step (the base); every step holds
+// only the tiles where the canvas differed from the base, with the content
+// the base had there. Undoing or redoing a step swaps its tiles with the
+// canvas, so afterwards the very same entry describes the opposite direction
+// and is pushed onto the other stack as is.
+//
+// Entries deeper than BACKUP_HOT_ENTRIES in either stack are handed to a
+// worker thread which run-length encodes their tiles one at a time, without
+// keeping the entry locked while it does. Pixel art and flat fills compress
+// very well this way. Tiles are decoded again right before the entry is
+// applied.
+//
+// With the journal enabled, steps which do not fit into the budget are not
+// forgotten: their tiles are appended to an unlinked file in the user cache
+// directory and only the tile headers stay in memory. The file is mapped and
+// the tiles are copied back when the step is applied. A step keeps its space
+// in the journal after that and writes into it again when it is spilled the
+// next time; the space of dropped steps is reused, or cut off the file when
+// it lies at the end.
+
+enum
+{
+  BACKUP_TILE_SIZE = 64,
+  BACKUP_HOT_ENTRIES = 8,
+};
+
+typedef struct
+{
+  gint x, y;
+  gint width, height;
+  guchar *data; // width * height pixels, rows packed without padding
+  gsize length; // Size of data, less than the pixels take if encoded
+  guint64 offset; // Position in the journal while spilled
+} BackupTile;
+
+typedef struct
+{
+  // Geometry of the canvas the tiles were taken from. If it does not match
+  // the current canvas, the tiles cover the whole of that canvas.
+  gint width, height;
+  cairo_format_t format;
+  gint bpp;
+  GArray *tiles;
+  gsize size; // Bytes held by the entry
+
+  // The compression worker may hold a reference to the entry. The lock
+  // guards the tiles, size and flags below.
+  gint ref;
+  GMutex lock;
+  gboolean encoded; // Tiles are run-length encoded
+  gboolean pending; // Queued for compression
+  gboolean dropped; // No longer part of the history
+  gboolean spilled; // Tile data lives in the journal
+  guint generation; // Changes whenever the tiles are swapped or spilled
+
+  // Space in the journal owned by the entry, extent_length is 0 if none.
+  guint64 extent_offset;
+  guint64 extent_length;
+} BackupEntry;
+
+typedef struct
+{
+  guint64 offset;
+  guint64 length;
+} JournalExtent;
+
+struct _BackupJournal
+{
+  int fd;
+  guint64 length; // End of the used space
+  GArray *holes; // Unused extents before the end, sorted by offset
+  guchar *map;
+  gsize mapped;
+};
+
 // Creates an empty surface of the same size and format as src.
 static cairo_surface_t *
 duplicate_surface (cairo_surface_t *src)
@@ -23,100 +105,1091 @@ duplicate_surface (cairo_surface_t *src)
   return copy;
 }
 
+static inline guchar *
+surface_pixel (cairo_surface_t *surface, gint x, gint y, gint bpp)
+{
+  return cairo_image_surface_get_data (surface) + (gsize) y * cairo_image_surface_get_stride (surface) + (gsize) x * bpp;
+}
+
+static void
+tile_read (BackupTile *tile, cairo_surface_t *surface, gint bpp)
+{
+  const gsize row = (gsize) tile->width * bpp;
+
+  for (gint y = 0; y < tile->height; y++)
+    memcpy (tile->data + y * row, surface_pixel (surface, tile->x, tile->y + y, bpp), row);
+}
+
+static void
+tile_write (const BackupTile *tile, cairo_surface_t *surface, gint bpp)
+{
+  const gsize row = (gsize) tile->width * bpp;
+
+  for (gint y = 0; y < tile->height; y++)
+    memcpy (surface_pixel (surface, tile->x, tile->y + y, bpp), tile->data + y * row, row);
+}
+
+// Exchanges the tile content with the same region of the surface. Rows are
+// swapped in chunks, so any pixel size fits the buffer.
+static void
+tile_swap (BackupTile *tile, cairo_surface_t *surface, gint bpp)
+{
+  const gsize row = (gsize) tile->width * bpp;
+  guchar tmp[BACKUP_TILE_SIZE * 4];
+
+  for (gint y = 0; y < tile->height; y++)
+    {
+      guchar *pixels = surface_pixel (surface, tile->x, tile->y + y, bpp);
+      guchar *data = tile->data + y * row;
+
+      for (gsize done = 0; done < row; done += sizeof (tmp))
+        {
+          const gsize n = MIN (sizeof (tmp), row - done);
+
+          memcpy (tmp, pixels + done, n);
+          memcpy (pixels + done, data + done, n);
+          memcpy (data + done, tmp, n);
+        }
+    }
+}
+
+static inline gsize
+tile_bytes (const BackupTile *tile, gint bpp)
+{
+  return (gsize) tile->width * tile->height * bpp;
+}
+
+// Run-length encodes count pixels of bpp bytes each. A control byte below
+// 128 is followed by that many plus one literal pixels, a larger one by a
+// single pixel repeated (control - 126) times. dst must have room for
+// count * (bpp + 1) bytes. Returns the encoded length.
+static gsize
+rle_encode (const guchar *src, gsize count, gint bpp, guchar *dst)
+{
+  guchar *out = dst;
+  gsize i = 0;
+
+  while (i < count)
+    {
+      gsize run = 1;
+
+      while (i + run < count && run < 129 && memcmp (src + (i + run) * bpp, src + i * bpp, bpp) == 0)
+        run++;
+
+      if (run >= 2)
+        {
+          *out++ = (guchar) (run + 126);
+          memcpy (out, src + i * bpp, bpp);
+          out += bpp;
+          i += run;
+          continue;
+        }
+
+      // Collect literals up to the start of the next run.
+      const gsize start = i;
+      gsize n = 0;
+
+      while (i < count && n < 128)
+        {
+          if (i + 1 < count && memcmp (src + (i + 1) * bpp, src + i * bpp, bpp) == 0)
+            break;
+
+          i++;
+          n++;
+        }
+
+      *out++ = (guchar) (n - 1);
+      memcpy (out, src + start * bpp, n * bpp);
+      out += n * bpp;
+    }
+
+  return out - dst;
+}
+
+static void
+rle_decode (const guchar *src, gsize length, gint bpp, guchar *dst)
+{
+  const guchar *end = src + length;
+
+  while (src < end)
+    {
+      const guint control = *src++;
+
+      if (control < 128)
+        {
+          const gsize n = (gsize) (control + 1) * bpp;
+          memcpy (dst, src, n);
+          dst += n;
+          src += n;
+        }
+      else
+        {
+          for (guint i = 0; i < control - 126; i++, dst += bpp)
+            memcpy (dst, src, bpp);
+
+          src += bpp;
+        }
+    }
+}
+
+static gboolean
+region_differs (cairo_surface_t *a, cairo_surface_t *b, gint x, gint y, gint width, gint height, gint bpp)
+{
+  const gsize row = (gsize) width * bpp;
+
+  for (gint i = 0; i < height; i++)
+    if (memcmp (surface_pixel (a, x, y + i, bpp), surface_pixel (b, x, y + i, bpp), row) != 0)
+      return TRUE;
+
+  return FALSE;
+}
+
+static BackupEntry *
+entry_new (cairo_surface_t *surface)
+{
+  BackupEntry *entry = g_new (BackupEntry, 1);
+  entry->width = cairo_image_surface_get_width (surface);
+  entry->height = cairo_image_surface_get_height (surface);
+  entry->format = cairo_image_surface_get_format (surface);
+  entry->bpp = gpaint_cairo_get_bytes_per_pixel (surface);
+  entry->tiles = g_array_new (FALSE, FALSE, sizeof (BackupTile));
+  entry->size = sizeof (BackupEntry);
+  entry->ref = 1;
+  g_mutex_init (&entry->lock);
+  entry->encoded = entry->pending = entry->dropped = entry->spilled = FALSE;
+  entry->generation = 0;
+  entry->extent_offset = entry->extent_length = 0;
+  return entry;
+}
+
+static void
+entry_add_tile (BackupEntry *entry, cairo_surface_t *surface, gint x, gint y, gint width, gint height)
+{
+  BackupTile tile = {
+    .x = x,
+    .y = y,
+    .width = width,
+    .height = height,
+    .data = g_malloc ((gsize) width * height * entry->bpp),
+    .length = (gsize) width * height * entry->bpp,
+  };
+
+  tile_read (&tile, surface, entry->bpp);
+  g_array_append_val (entry->tiles, tile);
+  entry->size += sizeof (BackupTile) + tile.length;
+}
+
+static void
+entry_free_tiles (BackupEntry *entry)
+{
+  for (guint i = 0; i < entry->tiles->len; i++)
+    g_free (g_array_index (entry->tiles, BackupTile, i).data);
+
+  g_array_set_size (entry->tiles, 0);
+  entry->size = sizeof (BackupEntry);
+}
+
+static void
+entry_unref (BackupEntry *entry)
+{
+  if (!g_atomic_int_dec_and_test (&entry->ref))
+    return;
+
+  entry_free_tiles (entry);
+  g_array_free (entry->tiles, TRUE);
+  g_mutex_clear (&entry->lock);
+  g_free (entry);
+}
+
+// Restores the raw pixels of encoded tiles. Returns the change of the entry
+// size. Called with the entry locked.
+static gssize
+entry_decode (BackupEntry *entry)
+{
+  const gsize old_size = entry->size;
+
+  for (guint i = 0; i < entry->tiles->len; i++)
+    {
+      BackupTile *tile = &g_array_index (entry->tiles, BackupTile, i);
+      const gsize raw = tile_bytes (tile, entry->bpp);
+
+      if (tile->length == raw)
+        continue;
+
+      guchar *data = g_malloc (raw);
+      rle_decode (tile->data, tile->length, entry->bpp, data);
+      g_free (tile->data);
+      entry->size += raw - tile->length;
+      tile->data = data;
+      tile->length = raw;
+    }
+
+  entry->encoded = FALSE;
+  return (gssize) entry->size - (gssize) old_size;
+}
+
+static BackupJournal *
+journal_new (void)
+{
+  g_autofree gchar *dir = g_build_filename (g_get_user_cache_dir (), "gpaint", NULL);
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+      g_warning ("Failed to create %s: %s", dir, g_strerror (errno));
+      return NULL;
+    }
+
+  g_autofree gchar *path = g_build_filename (dir, "history-XXXXXX", NULL);
+  const int fd = g_mkstemp (path);
+
+  if (fd < 0)
+    {
+      g_warning ("Failed to create the history journal: %s", g_strerror (errno));
+      return NULL;
+    }
+
+  // Nobody else needs the file, and this way it is gone even after a crash.
+  g_unlink (path);
+
+  BackupJournal *journal = g_new0 (BackupJournal, 1);
+  journal->fd = fd;
+  journal->holes = g_array_new (FALSE, FALSE, sizeof (JournalExtent));
+  return journal;
+}
+
+static void
+journal_unmap (BackupJournal *journal)
+{
+  if (journal->map)
+    munmap (journal->map, journal->mapped);
+
+  journal->map = NULL;
+  journal->mapped = 0;
+}
+
+static void
+journal_free (BackupJournal *journal)
+{
+  journal_unmap (journal);
+  close (journal->fd);
+  g_array_free (journal->holes, TRUE);
+  g_free (journal);
+}
+
+// Finds room for length bytes, in the first hole large enough or at the end.
+static guint64
+journal_alloc (BackupJournal *journal, guint64 length)
+{
+  for (guint i = 0; i < journal->holes->len; i++)
+    {
+      JournalExtent *hole = &g_array_index (journal->holes, JournalExtent, i);
+
+      if (hole->length < length)
+        continue;
+
+      const guint64 offset = hole->offset;
+      hole->offset += length;
+      hole->length -= length;
+
+      if (hole->length == 0)
+        g_array_remove_index (journal->holes, i);
+
+      return offset;
+    }
+
+  const guint64 offset = journal->length;
+  journal->length += length;
+  return offset;
+}
+
+// Gives the extent back. Holes at the end of the journal are cut off the
+// file.
+static void
+journal_release (BackupJournal *journal, guint64 offset, guint64 length)
+{
+  guint i = 0;
+
+  while (i < journal->holes->len && g_array_index (journal->holes, JournalExtent, i).offset < offset)
+    i++;
+
+  const JournalExtent extent = { offset, length };
+  g_array_insert_val (journal->holes, i, extent);
+
+  // Merge with the neighbours.
+  if (i + 1 < journal->holes->len)
+    {
+      JournalExtent *hole = &g_array_index (journal->holes, JournalExtent, i);
+      const JournalExtent *next = &g_array_index (journal->holes, JournalExtent, i + 1);
+
+      if (hole->offset + hole->length == next->offset)
+        {
+          hole->length += next->length;
+          g_array_remove_index (journal->holes, i + 1);
+        }
+    }
+
+  if (i > 0)
+    {
+      JournalExtent *prev = &g_array_index (journal->holes, JournalExtent, i - 1);
+      const JournalExtent *hole = &g_array_index (journal->holes, JournalExtent, i);
+
+      if (prev->offset + prev->length == hole->offset)
+        {
+          prev->length += hole->length;
+          g_array_remove_index (journal->holes, i);
+        }
+    }
+
+  const JournalExtent *last = &g_array_index (journal->holes, JournalExtent, journal->holes->len - 1);
+
+  if (last->offset + last->length != journal->length)
+    return;
+
+  journal->length = last->offset;
+  g_array_set_size (journal->holes, journal->holes->len - 1);
+
+  // The mapping must not reach past the end of the file.
+  if (journal->mapped > journal->length)
+    journal_unmap (journal);
+
+  if (ftruncate (journal->fd, (off_t) journal->length) != 0)
+    g_warning ("Failed to truncate the history journal: %s", g_strerror (errno));
+}
+
+static gboolean
+journal_write (BackupJournal *journal, const guchar *data, gsize length, guint64 offset)
+{
+  while (length > 0)
+    {
+      const ssize_t written = pwrite (journal->fd, data, length, (off_t) offset);
+
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          g_warning ("Failed to write the history journal: %s", g_strerror (errno));
+          return FALSE;
+        }
+
+      data += written;
+      length -= written;
+      offset += written;
+    }
+
+  return TRUE;
+}
+
+// Makes sure the mapping covers the journal up to end.
+static gboolean
+journal_map (BackupJournal *journal, guint64 end)
+{
+  if (end <= journal->mapped)
+    return TRUE;
+
+  journal_unmap (journal);
+  journal->mapped = journal->length;
+  journal->map = mmap (NULL, journal->mapped, PROT_READ, MAP_SHARED, journal->fd, 0);
+
+  if (journal->map == MAP_FAILED)
+    {
+      g_warning ("Failed to map the history journal: %s", g_strerror (errno));
+      journal->map = NULL;
+      journal->mapped = 0;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+// Gives the journal space of the entry back. Called with the entry locked.
+static void
+entry_release_extent (BackupEntry *entry, BackupJournal *journal)
+{
+  if (entry->extent_length == 0)
+    return;
+
+  journal_release (journal, entry->extent_offset, entry->extent_length);
+  entry->extent_offset = entry->extent_length = 0;
+}
+
+// Writes the tile data to the journal and releases it. The space the entry
+// got when it was spilled before is reused if the tiles still fit into it.
+// Returns the change of the entry size. Called with the entry locked.
+static gssize
+entry_spill (BackupEntry *entry, BackupJournal *journal)
+{
+  const gsize old_size = entry->size;
+  guint64 length = 0;
+
+  for (guint i = 0; i < entry->tiles->len; i++)
+    length += g_array_index (entry->tiles, BackupTile, i).length;
+
+  if (entry->extent_length < length)
+    {
+      entry_release_extent (entry, journal);
+      entry->extent_offset = journal_alloc (journal, length);
+      entry->extent_length = length;
+    }
+
+  guint64 offset = entry->extent_offset;
+
+  for (guint i = 0; i < entry->tiles->len; i++)
+    {
+      BackupTile *tile = &g_array_index (entry->tiles, BackupTile, i);
+
+      if (!journal_write (journal, tile->data, tile->length, offset))
+        {
+          // Keep the tiles in memory and the journal free of holes past the
+          // end of the file.
+          entry_release_extent (entry, journal);
+          return 0;
+        }
+
+      tile->offset = offset;
+      offset += tile->length;
+    }
+
+  for (guint i = 0; i < entry->tiles->len; i++)
+    {
+      BackupTile *tile = &g_array_index (entry->tiles, BackupTile, i);
+      g_clear_pointer (&tile->data, g_free);
+      entry->size -= tile->length;
+    }
+
+  entry->spilled = TRUE;
+  entry->generation++;
+  return (gssize) entry->size - (gssize) old_size;
+}
+
+// Copies the tile data back from the journal. Returns the change of the
+// entry size, or 0 with the entry still spilled on failure. Called with the
+// entry locked.
+static gssize
+entry_load (BackupEntry *entry, BackupJournal *journal)
+{
+  const gsize old_size = entry->size;
+  const BackupTile *last = &g_array_index (entry->tiles, BackupTile, entry->tiles->len - 1);
+  const guint64 start = g_array_index (entry->tiles, BackupTile, 0).offset;
+  const guint64 end = last->offset + last->length;
+
+  if (!journal_map (journal, end))
+    return 0;
+
+  for (guint i = 0; i < entry->tiles->len; i++)
+    {
+      BackupTile *tile = &g_array_index (entry->tiles, BackupTile, i);
+      tile->data = g_malloc (tile->length);
+      memcpy (tile->data, journal->map + tile->offset, tile->length);
+      entry->size += tile->length;
+    }
+
+  // The pages are not needed until the next time, if there is one.
+  const gsize page = (gsize) sysconf (_SC_PAGESIZE);
+  const guint64 first = (start + page - 1) / page * page;
+
+  if (first < end)
+    madvise (journal->map + first, end - first, MADV_DONTNEED);
+
+  entry->spilled = FALSE;
+  return (gssize) entry->size - (gssize) old_size;
+}
+
+// Splits the whole surface into tiles and stores all of them.
+static BackupEntry *
+entry_new_full (cairo_surface_t *surface)
+{
+  BackupEntry *entry = entry_new (surface);
+
+  for (gint y = 0; y < entry->height; y += BACKUP_TILE_SIZE)
+    for (gint x = 0; x < entry->width; x += BACKUP_TILE_SIZE)
+      entry_add_tile (entry, surface, x, y,
+                      MIN (BACKUP_TILE_SIZE, entry->width - x),
+                      MIN (BACKUP_TILE_SIZE, entry->height - y));
+
+  return entry;
+}
+
+static gboolean
+same_geometry (cairo_surface_t *a, cairo_surface_t *b)
+{
+  return cairo_image_surface_get_width (a) == cairo_image_surface_get_width (b)
+         && cairo_image_surface_get_height (a) == cairo_image_surface_get_height (b)
+         && cairo_image_surface_get_format (a) == cairo_image_surface_get_format (b);
+}
+
+// Compares the surface with the base and returns the tiles of the base which
+// are about to be overwritten, or NULL if nothing changed. Brings the base up
+// to date with the surface. Only the tiles overlapping rect are compared,
+// unless it is NULL.
+static BackupEntry *
+diff_with_base (BackupManager *manager, cairo_surface_t *surface, const GdkRectangle *rect)
+{
+  cairo_surface_t *base = manager->base;
+
+  cairo_surface_flush (surface);
+
+  if (!same_geometry (base, surface))
+    {
+      BackupEntry *entry = entry_new_full (base);
+      cairo_surface_destroy (manager->base);
+      manager->base = duplicate_surface (surface);
+      return entry;
+    }
+
+  BackupEntry *entry = entry_new (base);
+  GdkRectangle area = { 0, 0, entry->width, entry->height };
+
+  if (rect && !gdk_rectangle_intersect (rect, &area, &area))
+    {
+      entry_unref (entry);
+      return NULL;
+    }
+
+  const gint x0 = area.x / BACKUP_TILE_SIZE * BACKUP_TILE_SIZE;
+  const gint y0 = area.y / BACKUP_TILE_SIZE * BACKUP_TILE_SIZE;
+
+  for (gint y = y0; y < area.y + area.height; y += BACKUP_TILE_SIZE)
+    for (gint x = x0; x < area.x + area.width; x += BACKUP_TILE_SIZE)
+      {
+        const gint width = MIN (BACKUP_TILE_SIZE, entry->width - x);
+        const gint height = MIN (BACKUP_TILE_SIZE, entry->height - y);
+
+        if (!region_differs (base, surface, x, y, width, height, entry->bpp))
+          continue;
+
+        entry_add_tile (entry, base, x, y, width, height);
+
+        // Keep the base in sync with the surface.
+        const gsize row = (gsize) width * entry->bpp;
+
+        for (gint i = 0; i < height; i++)
+          memcpy (surface_pixel (base, x, y + i, entry->bpp), surface_pixel (surface, x, y + i, entry->bpp), row);
+      }
+
+  cairo_surface_mark_dirty (base);
+
+  if (entry->tiles->len == 0)
+    {
+      entry_unref (entry);
+      return NULL;
+    }
+
+  return entry;
+}
+
+// manager->bytes is also updated by the compression worker.
+static inline void
+account (BackupManager *manager, gssize delta)
+{
+  g_atomic_pointer_add (&manager->bytes, delta);
+}
+
+static gboolean
+notify_changed (gpointer user_data)
+{
+  BackupManager *manager = user_data;
+
+  if (manager->changed)
+    manager->changed (manager, manager->changed_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+// Tells whether the entry is still worth encoding and has not changed since
+// the worker started on it. Called with the entry locked.
+static inline gboolean
+entry_unchanged (const BackupEntry *entry, guint generation)
+{
+  return !entry->dropped && !entry->spilled && entry->generation == generation;
+}
+
+// Replaces the tiles with their encoded form where that is smaller. The
+// lock is only held to copy a tile out and to publish its encoded form, so
+// undo and redo never wait for more than a tile; if the entry was swapped or
+// spilled in between, the rest of the work is thrown away.
+static void
+compress_entry (gpointer data, gpointer user_data)
+{
+  BackupEntry *entry = data;
+  BackupManager *manager = user_data;
+  guchar *raw = NULL, *buffer = NULL;
+  gssize delta = 0;
+
+  g_mutex_lock (&entry->lock);
+
+  const gboolean wanted = !entry->dropped && !entry->encoded && !entry->spilled;
+  const guint generation = entry->generation;
+  const gint bpp = entry->bpp;
+  const guint count = entry->tiles->len;
+
+  g_mutex_unlock (&entry->lock);
+
+  for (guint i = 0; wanted && i < count; i++)
+    {
+      g_mutex_lock (&entry->lock);
+
+      if (!entry_unchanged (entry, generation))
+        {
+          g_mutex_unlock (&entry->lock);
+          break;
+        }
+
+      const BackupTile *tile = &g_array_index (entry->tiles, BackupTile, i);
+      const gsize pixels = (gsize) tile->width * tile->height;
+      const gsize length = tile->length;
+
+      if (length != pixels * bpp)
+        {
+          g_mutex_unlock (&entry->lock);
+          continue;
+        }
+
+      if (!raw)
+        {
+          raw = g_malloc ((gsize) BACKUP_TILE_SIZE * BACKUP_TILE_SIZE * bpp);
+          buffer = g_malloc ((gsize) BACKUP_TILE_SIZE * BACKUP_TILE_SIZE * (bpp + 1));
+        }
+
+      memcpy (raw, tile->data, length);
+      g_mutex_unlock (&entry->lock);
+
+      const gsize encoded = rle_encode (raw, pixels, bpp, buffer);
+
+      if (encoded >= length)
+        continue;
+
+      g_mutex_lock (&entry->lock);
+
+      if (entry_unchanged (entry, generation))
+        {
+          BackupTile *target = &g_array_index (entry->tiles, BackupTile, i);
+
+          g_free (target->data);
+          target->data = g_realloc (buffer, encoded);
+          target->length = encoded;
+          entry->size -= length - encoded;
+          entry->encoded = TRUE;
+          account (manager, -(gssize) (length - encoded));
+          delta -= (gssize) (length - encoded);
+          buffer = g_malloc ((gsize) BACKUP_TILE_SIZE * BACKUP_TILE_SIZE * (bpp + 1));
+        }
+
+      g_mutex_unlock (&entry->lock);
+    }
+
+  g_free (raw);
+  g_free (buffer);
+
+  g_mutex_lock (&entry->lock);
+
+  // Mark the entry as done even if no tile got smaller, so it is not queued
+  // again.
+  if (wanted && entry_unchanged (entry, generation))
+    entry->encoded = TRUE;
+
+  entry->pending = FALSE;
+  g_mutex_unlock (&entry->lock);
+  entry_unref (entry);
+
+  if (delta != 0)
+    g_idle_add (notify_changed, manager);
+}
+
+// Hands the first entry below the hot top of the stack to the worker.
+static void
+schedule_compression (BackupManager *manager, GQueue *queue)
+{
+  BackupEntry *entry = g_queue_peek_nth (queue, BACKUP_HOT_ENTRIES);
+
+  if (!entry)
+    return;
+
+  g_mutex_lock (&entry->lock);
+
+  if (!entry->encoded && !entry->pending)
+    {
+      entry->pending = TRUE;
+      g_atomic_int_inc (&entry->ref);
+      g_thread_pool_push (manager->compressor, entry, NULL);
+    }
+
+  g_mutex_unlock (&entry->lock);
+}
+
 void
-init_backup_manager (BackupManager *manager)
+init_backup_manager (BackupManager *manager, cairo_surface_t *surface)
 {
   manager->undo = g_queue_new ();
   manager->redo = g_queue_new ();
+  manager->base = duplicate_surface (surface);
+  manager->unrecorded = cairo_region_create ();
+  manager->unrecorded_all = FALSE;
+  manager->bytes = 0;
+  manager->compressor = g_thread_pool_new (compress_entry, manager, 1, FALSE, NULL);
+}
+
+static void
+drop_entry (BackupManager *manager, BackupEntry *entry)
+{
+  g_mutex_lock (&entry->lock);
+
+  if (manager->journal)
+    entry_release_extent (entry, manager->journal);
+
+  entry->dropped = TRUE;
+  account (manager, -(gssize) entry->size);
+  g_mutex_unlock (&entry->lock);
+  entry_unref (entry);
 }
 
 static void
-clear_queue (GQueue *queue)
+clear_queue (BackupManager *manager, GQueue *queue)
 {
   while (!g_queue_is_empty (queue))
+    drop_entry (manager, (BackupEntry *) g_queue_pop_head (queue));
+}
+
+// Moves the oldest step of the stack that is still in memory to the
+// journal. The head of the stack stays in memory. Returns FALSE if there is
+// nothing left to spill.
+static gboolean
+spill_oldest (BackupManager *manager, GQueue *queue)
+{
+  for (GList *link = g_queue_peek_tail_link (queue); link && link->prev; link = link->prev)
+    {
+      BackupEntry *entry = link->data;
+
+      g_mutex_lock (&entry->lock);
+
+      if (entry->spilled)
+        {
+          g_mutex_unlock (&entry->lock);
+          continue;
+        }
+
+      const gssize delta = entry_spill (entry, manager->journal);
+      g_mutex_unlock (&entry->lock);
+
+      if (delta == 0)
+        return FALSE;
+
+      account (manager, delta);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+// Memory held by the copy of the canvas the steps are taken against.
+static gsize
+base_bytes (BackupManager *manager)
+{
+  if (!manager->base)
+    return 0;
+
+  return (gsize) cairo_image_surface_get_stride (manager->base) * cairo_image_surface_get_height (manager->base);
+}
+
+// Drops the oldest undo steps, then the furthest redo steps, until the
+// history and its base fit into the budget. With the journal, they are spilled to disk
+// instead, and nothing is dropped once only the stack heads are left in
+// memory. The most recent undo step is always kept, even if it alone
+// exceeds the budget.
+static void
+enforce_budget (BackupManager *manager)
+{
+  if (manager->budget == 0)
+    return;
+
+  while ((gsize) g_atomic_pointer_get (&manager->bytes) + base_bytes (manager) > manager->budget)
     {
-      cairo_surface_t *surface = (cairo_surface_t *) g_queue_pop_head (queue);
-      cairo_surface_destroy (surface);
+      if (manager->journal)
+        {
+          if (spill_oldest (manager, manager->undo) || spill_oldest (manager, manager->redo))
+            continue;
+
+          break;
+        }
+
+      if (g_queue_get_length (manager->undo) > 1)
+        drop_entry (manager, (BackupEntry *) g_queue_pop_tail (manager->undo));
+      else if (!g_queue_is_empty (manager->redo))
+        drop_entry (manager, (BackupEntry *) g_queue_pop_tail (manager->redo));
+      else
+        break;
+    }
+}
+
+static void
+update_actions (BackupManager *manager)
+{
+  // The actions do not exist until the application is activated.
+  if (manager->undo_action && manager->redo_action)
+    {
+      g_simple_action_set_enabled (manager->undo_action, !g_queue_is_empty (manager->undo));
+      g_simple_action_set_enabled (manager->redo_action, !g_queue_is_empty (manager->redo));
     }
+
+  if (manager->changed)
+    manager->changed (manager, manager->changed_data);
 }
 
-// Save a new backup from the main surface. Clears redo history.
+// Limits the memory held by the history to the given number of megabytes,
+// 0 removes the limit.
 void
-save_backup (BackupManager *manager, cairo_surface_t *main_surface)
+set_backup_budget (BackupManager *manager, gsize megabytes)
 {
-  // Clear the redo queue if the user makes a new change.
-  clear_queue (manager->redo);
+  manager->budget = megabytes * 1024 * 1024;
+  enforce_budget (manager);
+  update_actions (manager);
+}
 
-  // Duplicate and push the current state onto the undo queue.
-  cairo_surface_t *backup = duplicate_surface (main_surface);
+// Enables or disables keeping the steps which do not fit into the budget in a
+// journal on disk. Disabling it forgets the spilled steps.
+void
+set_backup_journal (BackupManager *manager, gboolean enable)
+{
+  if (enable == (manager->journal != NULL))
+    return;
 
-  g_queue_push_head (manager->undo, backup);
-  g_simple_action_set_enabled (manager->undo_action, !g_queue_is_empty (manager->undo));
-  g_simple_action_set_enabled (manager->redo_action, !g_queue_is_empty (manager->redo));
+  if (enable)
+    {
+      manager->journal = journal_new ();
+      return;
+    }
+
+  // Steps from the oldest one up to the newest spilled step can not be
+  // restored anymore.
+  GQueue *queues[] = { manager->undo, manager->redo };
+
+  for (guint i = 0; i < countof (queues); i++)
+    {
+      GList *link = g_queue_peek_head_link (queues[i]);
+
+      while (link && !((BackupEntry *) link->data)->spilled)
+        link = link->next;
+
+      while (link)
+        {
+          GList *next = link->next;
+          drop_entry (manager, link->data);
+          g_queue_delete_link (queues[i], link);
+          link = next;
+        }
+
+      // The rest no longer own any journal space.
+      for (link = g_queue_peek_head_link (queues[i]); link; link = link->next)
+        {
+          BackupEntry *entry = link->data;
+
+          g_mutex_lock (&entry->lock);
+          entry->extent_offset = entry->extent_length = 0;
+          g_mutex_unlock (&entry->lock);
+        }
+    }
+
+  g_clear_pointer (&manager->journal, journal_free);
+  update_actions (manager);
 }
 
-// Applies the content of backup surface to the destination surface.
-static void
-apply_backup (AppState *state, cairo_surface_t *backup)
+// Reports the memory held by the history, both stacks and the copy of the
+// canvas the steps are taken against, and the number of steps in the stacks.
+void
+get_backup_usage (BackupManager *manager, gsize *bytes, guint *entries)
+{
+  if (bytes)
+    *bytes = (gsize) g_atomic_pointer_get (&manager->bytes) + base_bytes (manager);
+
+  if (entries)
+    *entries = g_queue_get_length (manager->undo) + g_queue_get_length (manager->redo);
+}
+
+// Notes that the canvas is about to be edited inside rect, or everywhere if
+// it is NULL, so that undo and redo record the edit if nobody saved it by
+// then.
+void
+mark_backup_dirty (BackupManager *manager, const GdkRectangle *rect)
+{
+  if (rect)
+    cairo_region_union_rectangle (manager->unrecorded, rect);
+  else
+    manager->unrecorded_all = TRUE;
+}
+
+// Record the changes made to the surface since the last recorded step.
+// Must be called after the surface is modified. Clears redo history if
+// anything has changed.
+void
+save_backup (BackupManager *manager, cairo_surface_t *surface)
+{
+  save_backup_region (manager, surface, NULL);
+}
+
+// Same as save_backup, for callers which know that nothing outside rect has
+// changed since the last recorded step.
+void
+save_backup_region (BackupManager *manager, cairo_surface_t *surface, const GdkRectangle *rect)
 {
-  if (cairo_image_surface_get_width (backup) != cairo_image_surface_get_width (state->main_surface) || cairo_image_surface_get_height (backup) != cairo_image_surface_get_height (state->main_surface))
+  if (rect)
+    cairo_region_subtract_rectangle (manager->unrecorded, rect);
+  else
     {
-      state->main_surface = cairo_image_surface_create (cairo_image_surface_get_format (backup), cairo_image_surface_get_width (backup), cairo_image_surface_get_height (backup));
-      gtk_drawing_area_set_content_width (GTK_DRAWING_AREA (state->drawing_area), (int) (cairo_image_surface_get_width (state->main_surface) * state->zoom_level));
-      gtk_drawing_area_set_content_height (GTK_DRAWING_AREA (state->drawing_area), (int) (cairo_image_surface_get_height (state->main_surface) * state->zoom_level));
-      gtk_widget_queue_draw (state->drawing_area);
+      cairo_region_destroy (manager->unrecorded);
+      manager->unrecorded = cairo_region_create ();
+      manager->unrecorded_all = FALSE;
     }
 
-  // Clear the destination surface.
-  clear_canvas (state->main_surface);
-  gtk_widget_queue_draw (state->drawing_area); // TODO
-  // Now draw the backup onto the destination.
-  cairo_t *cr = cairo_create (state->main_surface);
-  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-  cairo_set_source_surface (cr, backup, 0, 0);
-  cairo_paint (cr);
-  cairo_destroy (cr);
+  BackupEntry *entry = diff_with_base (manager, surface, rect);
+
+  if (!entry)
+    return;
+
+  // Clear the redo queue if the user makes a new change.
+  clear_queue (manager, manager->redo);
+  g_queue_push_head (manager->undo, entry);
+  account (manager, (gssize) entry->size);
+  schedule_compression (manager, manager->undo);
+  enforce_budget (manager);
+  update_actions (manager);
 }
 
+// Exchanges the content of the entry with the canvas: the canvas gets the
+// stored state and the entry gets what the canvas had. Fails only if a
+// spilled entry can not be read back.
 static gboolean
-move (BackupManager *manager, AppState *state, GQueue *from, GQueue *to)
+entry_swap (BackupManager *manager, BackupEntry *entry, AppState *state)
 {
-  if (g_queue_is_empty (from))
-    return FALSE;
+  cairo_surface_t *surface = state->main_surface;
 
-  // Save the current state to the queue.
-  cairo_surface_t *current = duplicate_surface (state->main_surface);
+  // The worker holds the lock for at most one tile; bumping the generation
+  // makes it drop whatever it encoded from the old content.
+  g_mutex_lock (&entry->lock);
+  entry->generation++;
 
-  if (!current)
-    return FALSE;
+  if (entry->spilled)
+    {
+      const gssize delta = entry_load (entry, manager->journal);
 
-  g_queue_push_head (to, current);
+      if (entry->spilled)
+        {
+          g_mutex_unlock (&entry->lock);
+          return FALSE;
+        }
 
-  // Pop the most recent backup from the queue.
-  cairo_surface_t *backup = (cairo_surface_t *) g_queue_pop_head (from);
+      account (manager, delta);
+    }
+
+  if (entry->encoded)
+    account (manager, entry_decode (entry));
+
+  if (entry->width != cairo_image_surface_get_width (surface)
+      || entry->height != cairo_image_surface_get_height (surface)
+      || entry->format != cairo_image_surface_get_format (surface))
+    {
+      cairo_surface_t *restored = cairo_image_surface_create (entry->format, entry->width, entry->height);
+      BackupEntry *replaced = entry_new_full (surface);
+
+      cairo_surface_flush (restored);
+
+      for (guint i = 0; i < entry->tiles->len; i++)
+        tile_write (&g_array_index (entry->tiles, BackupTile, i), restored, entry->bpp);
+
+      cairo_surface_mark_dirty (restored);
+
+      account (manager, (gssize) replaced->size - (gssize) entry->size);
+      entry_free_tiles (entry);
+      g_array_free (entry->tiles, TRUE);
+      entry->width = replaced->width;
+      entry->height = replaced->height;
+      entry->format = replaced->format;
+      entry->bpp = replaced->bpp;
+      entry->tiles = replaced->tiles;
+      entry->size = replaced->size;
+      g_mutex_unlock (&entry->lock);
+
+      replaced->tiles = g_array_new (FALSE, FALSE, sizeof (BackupTile));
+      entry_unref (replaced);
+
+      cairo_surface_destroy (state->main_surface);
+      state->main_surface = restored;
+      cairo_surface_destroy (manager->base);
+      manager->base = duplicate_surface (restored);
+
+      gtk_drawing_area_set_content_width (GTK_DRAWING_AREA (state->drawing_area), (int) (entry->width * state->zoom_level));
+      gtk_drawing_area_set_content_height (GTK_DRAWING_AREA (state->drawing_area), (int) (entry->height * state->zoom_level));
+      return TRUE;
+    }
 
-  if (!backup)
+  cairo_surface_flush (surface);
+  cairo_surface_flush (manager->base);
+
+  for (guint i = 0; i < entry->tiles->len; i++)
+    {
+      BackupTile *tile = &g_array_index (entry->tiles, BackupTile, i);
+      tile_swap (tile, surface, entry->bpp);
+
+      // The base follows the canvas.
+      const gsize row = (gsize) tile->width * entry->bpp;
+
+      for (gint y = 0; y < tile->height; y++)
+        memcpy (surface_pixel (manager->base, tile->x, tile->y + y, entry->bpp),
+                surface_pixel (surface, tile->x, tile->y + y, entry->bpp), row);
+    }
+
+  cairo_surface_mark_dirty (surface);
+  cairo_surface_mark_dirty (manager->base);
+  g_mutex_unlock (&entry->lock);
+  return TRUE;
+}
+
+static gboolean
+move (BackupManager *manager, AppState *state, GQueue *from, GQueue *to)
+{
+  // Changes which were not recorded yet become a step of their own, so the
+  // tiles below are swapped against the state the base describes. Only the
+  // marked part of the canvas is compared.
+  if (manager->unrecorded_all)
+    save_backup (manager, state->main_surface);
+  else if (!cairo_region_is_empty (manager->unrecorded))
+    {
+      GdkRectangle rect;
+      cairo_region_get_extents (manager->unrecorded, &rect);
+      save_backup_region (manager, state->main_surface, &rect);
+    }
+
+  if (g_queue_is_empty (from))
     return FALSE;
 
-  // Apply the backup to the main surface.
-  apply_backup (state, backup);
-  cairo_surface_destroy (backup);
-  g_simple_action_set_enabled (manager->undo_action, !g_queue_is_empty (manager->undo));
-  g_simple_action_set_enabled (manager->redo_action, !g_queue_is_empty (manager->redo));
+  // Pop the most recent backup from the queue.
+  BackupEntry *entry = (BackupEntry *) g_queue_pop_head (from);
+
+  // Apply the backup to the main surface, the entry now holds the state
+  // needed to come back.
+  if (!entry_swap (manager, entry, state))
+    {
+      g_queue_push_head (from, entry);
+      return FALSE;
+    }
+
+  g_queue_push_head (to, entry);
+  schedule_compression (manager, to);
+  enforce_budget (manager);
+  update_actions (manager);
   return TRUE;
 }
 
-// Undo: move one backup back. Copies the most recent backup from the undo
-// queue to the main surface, while saving the current state to the redo queue.
-// Returns 1 on success, 0 if no backup available.
+// Undo: move one backup back. Swaps the most recent backup from the undo
+// queue with the main surface and pushes it to the redo queue.
+// Returns TRUE on success, FALSE if no backup available.
 gboolean
 move_backward (BackupManager *manager, AppState *state)
 {
   return move (manager, state, manager->undo, manager->redo);
 }
 
-// Redo: move one backup forward. Copies the most recent backup from the redo
-// queue to the main surface, while saving the current state to the undo queue.
+// Redo: move one backup forward. Swaps the most recent backup from the redo
+// queue with the main surface and pushes it to the undo queue.
 // Returns TRUE on success, FALSE if no backup available.
 gboolean
 move_forward (BackupManager *manager, AppState *state)
@@ -128,8 +1201,16 @@ move_forward (BackupManager *manager, AppState *state)
 void
 free_backup_manager (BackupManager *manager)
 {
-  clear_queue (manager->undo);
-  clear_queue (manager->redo);
+  clear_queue (manager, manager->undo);
+  clear_queue (manager, manager->redo);
+
+  // Queued entries are dropped by now, so the worker only releases them.
+  g_thread_pool_free (manager->compressor, FALSE, TRUE);
+  manager->compressor = NULL;
+  g_clear_pointer (&manager->journal, journal_free);
+
   g_queue_free (manager->undo);
   g_queue_free (manager->redo);
+  g_clear_pointer (&manager->base, cairo_surface_destroy);
+  g_clear_pointer (&manager->unrecorded, cairo_region_destroy);
 }
@@ -9,11 +9,18 @@
 
 // BackupManager holds two GQueue objects for undo and redo.
 typedef struct _BackupManager BackupManager;
+typedef struct _BackupJournal BackupJournal;
 
-extern void init_backup_manager (BackupManager *manager);
+extern void init_backup_manager (BackupManager *manager, cairo_surface_t *surface);
 extern void free_backup_manager (BackupManager *manager);
 
-extern void save_backup (BackupManager *manager, cairo_surface_t *main_surface);
+extern void save_backup (BackupManager *manager, cairo_surface_t *surface);
+extern void save_backup_region (BackupManager *manager, cairo_surface_t *surface, const GdkRectangle *rect);
+extern void mark_backup_dirty (BackupManager *manager, const GdkRectangle *rect);
 
 extern gboolean move_backward (BackupManager *manager, AppState *state);
 extern gboolean move_forward (BackupManager *manager, AppState *state);
+
+extern void set_backup_budget (BackupManager *manager, gsize megabytes);
+extern void set_backup_journal (BackupManager *manager, gboolean enable);
+extern void get_backup_usage (BackupManager *manager, gsize *bytes, guint *entries);
@@ -0,0 +1,256 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame-stats.h"
+#include "utils.h"
+
+// Timings of the stages of recent frames. Every function accepts a NULL
+// FrameStats and does nothing then, so the drawing code can be instrumented
+// unconditionally. Stages may run several times per frame (once per canvas
+// tile, for example); their times are summed.
+//
+// A frame counts as presented when the frame clock finishes painting it. The
+// latency of a frame is measured from the first input event handled since the
+// previous one.
+
+enum
+{
+  FRAME_STATS_SAMPLES = 256, // Frames the percentiles are taken over
+};
+
+static const gchar *const stage_names[FRAME_STAGE_COUNT] = {
+  [FRAME_STAGE_BACKGROUND] = "background",
+  [FRAME_STAGE_MAIN] = "main",
+  [FRAME_STAGE_PREVIEW] = "preview",
+  [FRAME_STAGE_SELECTION] = "selection",
+  [FRAME_STAGE_GRID] = "grid",
+  [FRAME_STAGE_CURSOR] = "cursor",
+  [FRAME_STAGE_FRAME] = "frame",
+  [FRAME_STAGE_LATENCY] = "latency",
+  [FRAME_STAGE_PREDICTED] = "predicted",
+};
+
+struct _FrameStats
+{
+  gint64 samples[FRAME_STAGE_COUNT][FRAME_STATS_SAMPLES]; // Microseconds
+  guint counts[FRAME_STAGE_COUNT];
+  gint64 current[FRAME_STAGE_COUNT]; // Frame being drawn
+  gint64 frame_start;
+  gint64 input; // Time of the first input not yet presented, 0 if none
+  gint64 lead; // Input predicted ahead by the frame being drawn
+  gboolean drawn; // A frame was drawn and not yet presented
+  guint64 frames;
+
+  GdkFrameClock *clock;
+  gulong after_paint_id;
+  FILE *csv;
+};
+
+static void
+frame_stats_push (FrameStats *stats, FrameStage stage, gint64 value)
+{
+  stats->samples[stage][stats->counts[stage]++ % FRAME_STATS_SAMPLES] = value;
+}
+
+static void
+on_after_paint (GdkFrameClock *clock, gpointer user_data)
+{
+  FrameStats *stats = user_data;
+  gint64 latency = -1;
+
+  if (!stats->drawn)
+    return;
+
+  if (stats->input)
+    {
+      latency = g_get_monotonic_time () - stats->input;
+      frame_stats_push (stats, FRAME_STAGE_LATENCY, latency);
+      frame_stats_push (stats, FRAME_STAGE_PREDICTED, MAX (latency - stats->lead, 0));
+      stats->input = 0;
+    }
+
+  if (stats->csv)
+    {
+      fprintf (stats->csv, "%" G_GUINT64_FORMAT ",%" G_GINT64_FORMAT, stats->frames, stats->frame_start);
+
+      for (int i = 0; i < FRAME_STAGE_LATENCY; i++)
+        fprintf (stats->csv, ",%" G_GINT64_FORMAT, stats->current[i]);
+
+      if (latency >= 0)
+        fprintf (stats->csv, ",%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT "\n", latency, MAX (latency - stats->lead, 0));
+      else
+        fputs (",,\n", stats->csv);
+    }
+
+  stats->drawn = FALSE;
+}
+
+// Starts collecting timings of the frames of widget, which must be realized.
+// They are also written to csv_path, one frame per line, unless it is NULL.
+FrameStats *
+frame_stats_new (GtkWidget *widget, const gchar *csv_path)
+{
+  FrameStats *stats = g_new0 (FrameStats, 1);
+
+  if (csv_path)
+    {
+      stats->csv = fopen (csv_path, "w");
+
+      if (!stats->csv)
+        g_printerr ("Failed to open %s: %s\n", csv_path, g_strerror (errno));
+      else
+        {
+          fputs ("frame,start_us", stats->csv);
+
+          for (int i = 0; i < FRAME_STAGE_COUNT; i++)
+            fprintf (stats->csv, ",%s_us", stage_names[i]);
+
+          fputc ('\n', stats->csv);
+        }
+    }
+
+  stats->clock = gtk_widget_get_frame_clock (widget);
+
+  if (stats->clock)
+    {
+      g_object_ref (stats->clock);
+      stats->after_paint_id = g_signal_connect (stats->clock, "after-paint", G_CALLBACK (on_after_paint), stats);
+    }
+  else
+    g_warning ("Frame timings need a realized widget.");
+
+  return stats;
+}
+
+void
+frame_stats_free (FrameStats *stats)
+{
+  if (!stats)
+    return;
+
+  if (stats->clock)
+    {
+      g_signal_handler_disconnect (stats->clock, stats->after_paint_id);
+      g_object_unref (stats->clock);
+    }
+
+  if (stats->csv)
+    fclose (stats->csv);
+
+  g_free (stats);
+}
+
+// Start time for frame_stats_add(), only read when timings are collected.
+gint64
+frame_stats_now (FrameStats *stats)
+{
+  return stats ? g_get_monotonic_time () : 0;
+}
+
+// Adds the time since start to stage of the current frame.
+void
+frame_stats_add (FrameStats *stats, FrameStage stage, gint64 start)
+{
+  if (stats)
+    stats->current[stage] += g_get_monotonic_time () - start;
+}
+
+void
+frame_stats_begin_frame (FrameStats *stats)
+{
+  if (!stats)
+    return;
+
+  memset (stats->current, 0, sizeof (stats->current));
+  stats->lead = 0;
+  stats->frame_start = g_get_monotonic_time ();
+}
+
+void
+frame_stats_end_frame (FrameStats *stats)
+{
+  if (!stats || !stats->frame_start)
+    return;
+
+  stats->current[FRAME_STAGE_FRAME] = g_get_monotonic_time () - stats->frame_start;
+
+  for (int i = 0; i < FRAME_STAGE_LATENCY; i++)
+    frame_stats_push (stats, i, stats->current[i]);
+
+  stats->frames++;
+  stats->drawn = TRUE;
+}
+
+// Records that an input event was handled; the next presented frame shows it.
+void
+frame_stats_input (FrameStats *stats)
+{
+  if (stats && !stats->input)
+    stats->input = g_get_monotonic_time ();
+}
+
+// Records that the frame being drawn shows the input predicted lead
+// microseconds ahead.
+void
+frame_stats_set_lead (FrameStats *stats, gint64 lead)
+{
+  if (stats)
+    stats->lead = lead;
+}
+
+static int
+compare_samples (const void *a, const void *b)
+{
+  const gint64 x = *(const gint64 *) a;
+  const gint64 y = *(const gint64 *) b;
+  return (x > y) - (x < y);
+}
+
+// Draws a table of the 50th, 95th and 99th percentile of every stage over
+// the last frames, with its top left corner at (x, y).
+void
+frame_stats_draw (FrameStats *stats, cairo_t *cr, double x, double y)
+{
+  const double line_height = 14.0;
+  gint64 sorted[FRAME_STATS_SAMPLES];
+  gchar line[128];
+
+  if (!stats)
+    return;
+
+  cairo_save (cr);
+  cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 0.7);
+  cairo_rectangle (cr, x, y, 300.0, line_height * (FRAME_STAGE_COUNT + 1) + 8.0);
+  cairo_fill (cr);
+
+  cairo_select_font_face (cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+  cairo_set_font_size (cr, 12.0);
+  cairo_set_source_rgb (cr, 1.0, 1.0, 1.0);
+
+  cairo_move_to (cr, x + 6.0, y + line_height);
+  cairo_show_text (cr, "stage         p50    p95    p99 ms");
+
+  for (int i = 0; i < FRAME_STAGE_COUNT; i++)
+    {
+      const guint count = min_int (stats->counts[i], FRAME_STATS_SAMPLES);
+
+      if (count == 0)
+        g_snprintf (line, sizeof (line), "%-10s      -      -      -", stage_names[i]);
+      else
+        {
+          memcpy (sorted, stats->samples[i], count * sizeof (sorted[0]));
+          qsort (sorted, count, sizeof (sorted[0]), compare_samples);
+          g_snprintf (line, sizeof (line), "%-10s %6.2f %6.2f %6.2f", stage_names[i],
+                      sorted[count * 50 / 100] / 1000.0,
+                      sorted[count * 95 / 100] / 1000.0,
+                      sorted[count * 99 / 100] / 1000.0);
+        }
+
+      cairo_move_to (cr, x + 6.0, y + line_height * (i + 2));
+      cairo_show_text (cr, line);
+    }
+
+  cairo_restore (cr);
+}
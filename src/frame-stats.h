@@ -0,0 +1,29 @@
+#pragma once
+
+#include <gtk/gtk.h>
+
+typedef enum
+{
+  FRAME_STAGE_BACKGROUND,
+  FRAME_STAGE_MAIN,
+  FRAME_STAGE_PREVIEW,
+  FRAME_STAGE_SELECTION,
+  FRAME_STAGE_GRID,
+  FRAME_STAGE_CURSOR,
+  FRAME_STAGE_FRAME,   // Whole frame
+  FRAME_STAGE_LATENCY, // From an input event to the frame showing it
+  FRAME_STAGE_PREDICTED, // Latency less the time the frame drew ahead of the input
+  FRAME_STAGE_COUNT,
+} FrameStage;
+
+typedef struct _FrameStats FrameStats;
+
+extern FrameStats *frame_stats_new (GtkWidget *widget, const gchar *csv_path);
+extern void frame_stats_free (FrameStats *stats);
+extern gint64 frame_stats_now (FrameStats *stats);
+extern void frame_stats_add (FrameStats *stats, FrameStage stage, gint64 start);
+extern void frame_stats_begin_frame (FrameStats *stats);
+extern void frame_stats_end_frame (FrameStats *stats);
+extern void frame_stats_input (FrameStats *stats);
+extern void frame_stats_set_lead (FrameStats *stats, gint64 lead);
+extern void frame_stats_draw (FrameStats *stats, cairo_t *cr, double x, double y);
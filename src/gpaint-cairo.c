@@ -0,0 +1,116 @@
+#include <gtk/gtk.h>
+#include <math.h>
+
+#include "gpaint-cairo.h"
+#include "utils.h"
+
+// Checkerboard tiles rendered so far. Zoom levels map to a handful of cell
+// sizes, so a few slots are enough and the oldest one is recycled.
+static struct
+{
+  int cell;
+  cairo_pattern_t *pattern;
+} checkerboards[4];
+static guint next_checkerboard;
+
+static cairo_pattern_t *
+create_checkerboard (int cell)
+{
+  const double bg[2] = { GPAINT_TRANSPARENT_FIRST_COLOR, GPAINT_TRANSPARENT_SECOND_COLOR };
+  cairo_surface_t *tile = cairo_image_surface_create (CAIRO_FORMAT_RGB24, 2 * cell, 2 * cell);
+  cairo_t *cr = create_cairo (tile, CAIRO_OPERATOR_SOURCE, CAIRO_ANTIALIAS_NONE);
+
+  cairo_set_source_rgb (cr, bg[1], bg[1], bg[1]);
+  cairo_paint (cr);
+  cairo_set_source_rgb (cr, bg[0], bg[0], bg[0]);
+  cairo_rectangle (cr, 0, 0, cell, cell);
+  cairo_rectangle (cr, cell, cell, cell, cell);
+  cairo_fill (cr);
+  cairo_destroy (cr);
+
+  cairo_pattern_t *pattern = cairo_pattern_create_for_surface (tile);
+  cairo_pattern_set_extend (pattern, CAIRO_EXTEND_REPEAT);
+  cairo_pattern_set_filter (pattern, CAIRO_FILTER_NEAREST);
+  cairo_surface_destroy (tile);
+  return pattern;
+}
+
+// Uses a checkerboard with square cells of the given size, in user space
+// units, as the source of cr. The cells are aligned to (x, y).
+void
+gpaint_cairo_set_source_checkerboard (cairo_t *cr, int cell, double x, double y)
+{
+  cairo_pattern_t *pattern = NULL;
+  cairo_matrix_t matrix;
+
+  cell = max_int (cell, 1);
+
+  for (gsize i = 0; i < countof (checkerboards); i++)
+    if (checkerboards[i].pattern && checkerboards[i].cell == cell)
+      pattern = checkerboards[i].pattern;
+
+  if (!pattern)
+    {
+      const guint slot = next_checkerboard++ % countof (checkerboards);
+
+      g_clear_pointer (&checkerboards[slot].pattern, cairo_pattern_destroy);
+      checkerboards[slot].cell = cell;
+      checkerboards[slot].pattern = pattern = create_checkerboard (cell);
+    }
+
+  cairo_matrix_init_translate (&matrix, -x, -y);
+  cairo_pattern_set_matrix (pattern, &matrix);
+  cairo_set_source (cr, pattern);
+}
+
+// The pixel grid tile of the last zoom level.
+static struct
+{
+  double size;
+  double shade;
+  cairo_pattern_t *pattern;
+} grid;
+
+// Uses a grid of grey lines one unit wide as the source of cr. The lines are
+// centred on the multiples of size.
+void
+gpaint_cairo_set_source_grid (cairo_t *cr, double size, double shade)
+{
+  const int n = max_int ((int) ceil (size), 2);
+  cairo_matrix_t matrix;
+
+  if (!grid.pattern || grid.size != size || grid.shade != shade)
+    {
+      cairo_surface_t *tile = create_surface (n, n);
+      cairo_t *tile_cr = create_cairo (tile, CAIRO_OPERATOR_SOURCE, CAIRO_ANTIALIAS_NONE);
+
+      cairo_set_source_rgb (tile_cr, shade, shade, shade);
+      cairo_rectangle (tile_cr, 0, 0, 1, n);
+      cairo_rectangle (tile_cr, 0, 0, n, 1);
+      cairo_fill (tile_cr);
+      cairo_destroy (tile_cr);
+
+      g_clear_pointer (&grid.pattern, cairo_pattern_destroy);
+      grid.pattern = cairo_pattern_create_for_surface (tile);
+      grid.size = size;
+      grid.shade = shade;
+      cairo_pattern_set_extend (grid.pattern, CAIRO_EXTEND_REPEAT);
+      cairo_pattern_set_filter (grid.pattern, CAIRO_FILTER_NEAREST);
+      cairo_surface_destroy (tile);
+    }
+
+  // The tile starts half a line before a grid line and spans size units.
+  cairo_matrix_init_scale (&matrix, n / size, n / size);
+  cairo_matrix_translate (&matrix, 0.5, 0.5);
+  cairo_pattern_set_matrix (grid.pattern, &matrix);
+  cairo_set_source (cr, grid.pattern);
+}
+
+void
+gpaint_cairo_free_patterns (void)
+{
+  for (gsize i = 0; i < countof (checkerboards); i++)
+    g_clear_pointer (&checkerboards[i].pattern, cairo_pattern_destroy);
+
+  g_clear_pointer (&grid.pattern, cairo_pattern_destroy);
+}
@@ -134,64 +134,30 @@ clear_canvas (cairo_surface_t *surface)
   cairo_destroy (cr);
 }
 
-static inline void
-draw_transparent_square (cairo_t *cr, double px, double py, double pw, double ph, double scale)
+// Size of the canvas background checker cells at the given zoom, in widget
+// pixels.
+static inline int
+gpaint_checkerboard_cell (double zoom)
 {
-  cairo_save (cr);
-  GdkRectangle v = {
-    .x = (int) (px / scale),
-    .y = (int) (py / scale),
-    .width = (int) (pw / scale),
-    .height = (int) (ph / scale),
-  };
-
-  scale = 16.0; // TODO
-  // TODO cairo_set_antialias (cr, CAIRO_ANTIALIAS_NONE);
-  cairo_save (cr);
-  cairo_scale (cr, scale, scale);
+  return (int) round (zoom / (int) log2 (zoom));
+}
 
-  const double bg[] = { 0x54 / 255.0, 0xA8 / 255.0 };
+extern void gpaint_cairo_set_source_checkerboard (cairo_t *cr, int cell, double x, double y);
+extern void gpaint_cairo_set_source_grid (cairo_t *cr, double size, double shade);
+extern void gpaint_cairo_free_patterns (void);
 
-  cairo_set_source_rgb (cr, bg[0], bg[0], bg[0]);
-  cairo_rectangle (cr, v.x, v.y, v.width, v.height);
-  cairo_fill (cr);
-  cairo_restore (cr);
-
-  /* Draw checkerboard background */
+static inline void
+draw_transparent_square (cairo_t *cr, double px, double py, double pw, double ph)
+{
   cairo_save (cr);
-  int k = 2; // TODO make it adaptive for zoom.
-  cairo_scale (cr, scale / k, scale / k);
-
-  int grid_width = (v.x + v.width) * k;
-  int grid_height = (v.y + v.height) * k;
-
-  cairo_new_path (cr);
-  const double dash[] = { 1.0, 1.0 };
-  cairo_set_dash (cr, dash, 1, 0);
-  cairo_set_line_width (cr, 1.0);
-
-  for (int y = v.y * k; y < grid_height; y++)
-    {
-      double x0, x1, y0, y1;
-
-      x0 = v.x * k + (y & 1);
-      x1 = grid_width;
-      y0 = y1 = y + 0.5;
-
-      cairo_move_to (cr, x0, y0);
-      cairo_line_to (cr, x1, y1);
-    }
-
-  cairo_set_source_rgb (cr, bg[1], bg[1], bg[1]);
-  cairo_stroke (cr);
-  cairo_restore (cr);
-
+  gpaint_cairo_set_source_checkerboard (cr, 8, px, py);
+  cairo_rectangle (cr, px, py, pw, ph);
+  cairo_fill (cr);
   cairo_restore (cr);
 }
 
-// TODO FIX THIS SHIT
 static inline void
-draw_colored_square (cairo_t *cr, const GdkRGBA *color, gdouble px, gdouble py, gdouble pw, gdouble ph, gdouble scale)
+draw_colored_square (cairo_t *cr, const GdkRGBA *color, gdouble px, gdouble py, gdouble pw, gdouble ph)
 {
   if ((int) round (255.0 * color->alpha) == 255)
     {
@@ -202,7 +168,7 @@ draw_colored_square (cairo_t *cr, const GdkRGBA *color, gdouble px, gdouble py,
       cairo_restore (cr);
     }
   else
-    draw_transparent_square (cr, px, py, pw, ph, scale);
+    draw_transparent_square (cr, px, py, pw, ph);
 }
 
 static inline void
@@ -228,6 +194,18 @@ gdk_rgba_to_clr (const GdkRGBA *rgba)
   return (a << 24) | (r << 16) | (g << 8) | b; // ARGB format
 }
 
+// The color as stored in an ARGB32 surface, with premultiplied alpha.
+static inline guint32
+gdk_rgba_to_premultiplied_clr (const GdkRGBA *rgba)
+{
+  const double a = rgba->alpha;
+
+  return ((guint32) round (a * 255.0) << 24)
+         | ((guint32) round (rgba->red * a * 255.0) << 16)
+         | ((guint32) round (rgba->green * a * 255.0) << 8)
+         | (guint32) round (rgba->blue * a * 255.0);
+}
+
 /* static inline void */
 /* set_pixel_color (guint8 *data, gint x, gint y, gint stride, const GdkRGBA *color) */
 /* { */
@@ -280,6 +258,45 @@ rgba_equal (const GdkRGBA *rgba1, const GdkRGBA *rgba2)
   return a1 == a2;
 }
 
+// Grows dst to cover src. Rectangles with no area are ignored.
+static inline void
+gpaint_rectangle_union (GdkRectangle *dst, const GdkRectangle *src)
+{
+  if (src->width <= 0 || src->height <= 0)
+    return;
+
+  if (dst->width <= 0 || dst->height <= 0)
+    *dst = *src;
+  else
+    gdk_rectangle_union (dst, src, dst);
+}
+
+// Pixels the current path covers once stroked or filled, with a pixel of
+// margin for antialiasing.
+static inline GdkRectangle
+gpaint_cairo_path_bounds (cairo_t *cr, gboolean stroke)
+{
+  double x1, y1, x2, y2;
+
+  if (stroke)
+    cairo_stroke_extents (cr, &x1, &y1, &x2, &y2);
+  else
+    cairo_fill_extents (cr, &x1, &y1, &x2, &y2);
+
+  if (x2 <= x1 || y2 <= y1)
+    return (GdkRectangle) { 0, 0, 0, 0 };
+
+  cairo_user_to_device (cr, &x1, &y1);
+  cairo_user_to_device (cr, &x2, &y2);
+
+  const int left = (int) floor (fmin (x1, x2)) - 1;
+  const int top = (int) floor (fmin (y1, y2)) - 1;
+  const int right = (int) ceil (fmax (x1, x2)) + 1;
+  const int bottom = (int) ceil (fmax (y1, y2)) + 1;
+
+  return (GdkRectangle) { left, top, right - left, bottom - top };
+}
+
 static inline void
 copy_surface (cairo_surface_t *dst, cairo_surface_t *src)
 {
@@ -11,8 +11,28 @@ struct _BackupManager
 {
   GQueue *undo; // Stack of backups for undo (most recent at head)
   GQueue *redo; // Stack of backups for redo (most recent at head)
+  cairo_surface_t *base; // Canvas as of the last recorded step
+  cairo_region_t *unrecorded; // Edited since the last recorded step
+  gboolean unrecorded_all;    // Whole canvas edited, unrecorded is ignored
+  gsize bytes;           // Memory held by both stacks
+  gsize budget;          // Limit for bytes, 0 if unlimited
+  GThreadPool *compressor; // Encodes entries deep in the stacks
+  struct _BackupJournal *journal; // Steps over the budget, NULL if disabled
   GSimpleAction *undo_action;
   GSimpleAction *redo_action;
+  void (*changed) (struct _BackupManager *manager, gpointer user_data);
+  gpointer changed_data;
+};
+
+enum
+{
+  GPAINT_MIPMAP_LEVELS = 4, // Enough for the smallest zoom, 1/20
+};
+
+struct _Mipmap
+{
+  cairo_surface_t *levels[GPAINT_MIPMAP_LEVELS]; // Level n + 1 at index n
+  cairo_region_t *damage[GPAINT_MIPMAP_LEVELS];  // Canvas pixels to filter again
 };
 
 typedef struct
@@ -28,6 +48,20 @@ typedef enum
   FILL_SECONDARY,
 } FillType;
 
+typedef enum
+{
+  SYMMETRY_RADIAL, // symmetry_folds copies turned around the centre
+  SYMMETRY_X,      // Mirrored left and right of the centre
+  SYMMETRY_Y,      // Mirrored above and below the centre
+  SYMMETRY_XY,     // Mirrored both ways
+} SymmetryMode;
+
+typedef enum
+{
+  BRUSH_SHAPE_ROUND,
+  BRUSH_SHAPE_SQUARE,
+} BrushShape;
+
 typedef struct
 {
   const gchar *label;
@@ -60,6 +94,7 @@ typedef struct
   GtkWidget *file_toolbar;
   GtkWidget *image_info;
   GtkWidget *current_position;
+  GtkWidget *history_info;
   GtkWidget *width_selector;
   GtkWidget *fill_selector;
   GtkWidget *eraser_size_selector;
@@ -85,6 +120,26 @@ typedef struct
   /* cairo_format_t format; */
   cairo_surface_t *main_surface;
   cairo_surface_t *preview_surface;
+  GdkRectangle dirty_rect; // Part of the preview changed by the current stroke
+  cairo_t *lines_cr; // Lines of the stroke not yet drawn to the preview, if any
+  cairo_surface_t *preview_pool; // Preview kept between strokes
+  cairo_region_t *preview_copied; // Parts of main_surface copied into the preview
+
+  cairo_surface_t *view_surface; // Composited canvas under the visible area
+  GdkRectangle view_area; // Widget area view_surface covers
+  gdouble view_zoom;
+  gint view_scale;
+  cairo_region_t *view_damage; // Parts of view_surface to composite again, in widget pixels
+  GdkRectangle view_selection; // Floating selection as composited into view_surface
+  gboolean view_textured; // Canvas presented as textures instead of view_surface
+  GdkTexture **view_tiles; // Composited canvas tiles, NULL where damaged
+  gint view_tiles_width, view_tiles_height; // Canvas size the tiles cover
+  gint view_tiles_level; // Mipmap level the tiles are composited at
+  struct _Mipmap mipmap; // Main surface reduced for zooming out
+  struct _FrameStats *frame_stats; // Frame timings, NULL unless shown
+  struct _Trace *trace; // Input being recorded, NULL unless enabled
+  struct _Predictor *predictor; // Stroke tail prediction, NULL unless enabled
+  guint predictor_timeout_id; // Redraws once a predicted tail goes stale
 
   cairo_surface_t *selected_surface;
   gboolean has_selection;
@@ -105,10 +160,20 @@ typedef struct
   GdkCursor *cursors[32]; // TODO
   gdouble width;
   FillType fill_type;
+  guint fill_tolerance; // Per channel, for the bucket
+  gboolean fill_global; // Bucket replaces matching pixels everywhere
   gdouble eraser_size;
   gdouble brush_size;
+  BrushShape brush_shape;
+  gdouble brush_softness; // 0 for a hard edge up to 1 for a fully feathered one
+  gdouble brush_distance; // Along the stroke since its last dab
+  SymmetryMode symmetry_mode;
+  guint symmetry_folds; // Copies for SYMMETRY_RADIAL, 2 if 0
+  gdouble symmetry_offset_x, symmetry_offset_y; // Centre relative to the canvas centre
   Point start_point;
   Point last_point;
+  GArray *motion_points; // Pointer positions the stroke has yet to handle
+  guint motion_tick_id;  // Frame clock callback handling them, 0 if none
   ToolEntry *tools;
 
   gdouble cursor_x, cursor_y;
@@ -0,0 +1,85 @@
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <glib.h>
+
+// Hooks for -finstrument-functions, built into the instrumented profile when
+// the function_trace option is set. If GPAINT_FUNCTION_TRACE names a file,
+// every entry to and exit from a compiled function is appended to it, one
+// per line:
+//
+//   > function call_site thread microseconds
+//   < function call_site thread microseconds
+//
+// Addresses are relative to the start of the executable, so they can be
+// passed to addr2line -f -e gpaint as they are.
+
+#define NO_INSTRUMENT __attribute__ ((no_instrument_function))
+
+static FILE *trace_file;
+static gsize trace_base; // Where the executable is loaded
+static gint trace_threads;
+static __thread gint trace_thread; // 0 until the thread first logs
+
+extern void __cyg_profile_func_enter (void *function, void *call_site) NO_INSTRUMENT;
+extern void __cyg_profile_func_exit (void *function, void *call_site) NO_INSTRUMENT;
+
+static void NO_INSTRUMENT
+trace_log (char kind, void *function, void *call_site)
+{
+  if (!trace_file)
+    return;
+
+  if (!trace_thread)
+    trace_thread = g_atomic_int_add (&trace_threads, 1) + 1;
+
+  fprintf (trace_file, "%c %#" G_GSIZE_MODIFIER "x %#" G_GSIZE_MODIFIER "x %d %" G_GINT64_FORMAT "\n",
+           kind, (gsize) function - trace_base, (gsize) call_site - trace_base, trace_thread, g_get_monotonic_time ());
+}
+
+void
+__cyg_profile_func_enter (void *function, void *call_site)
+{
+  trace_log ('>', function, call_site);
+}
+
+void
+__cyg_profile_func_exit (void *function, void *call_site)
+{
+  trace_log ('<', function, call_site);
+}
+
+static void NO_INSTRUMENT __attribute__ ((constructor))
+trace_open (void)
+{
+  const char *path = g_getenv ("GPAINT_FUNCTION_TRACE");
+  Dl_info info;
+
+  if (!path)
+    return;
+
+  if (dladdr ((void *) trace_log, &info) && info.dli_fbase)
+    trace_base = (gsize) info.dli_fbase;
+
+  trace_file = fopen (path, "w");
+
+  if (!trace_file)
+    g_printerr ("Failed to open %s: %s\n", path, g_strerror (errno));
+}
+
+static void NO_INSTRUMENT __attribute__ ((destructor))
+trace_close (void)
+{
+  if (!trace_file)
+    return;
+
+  FILE *file = trace_file;
+
+  trace_file = NULL;
+  fclose (file);
+}
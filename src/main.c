@@ -14,10 +14,18 @@
 #include <locale.h>
 
 #include "formats.h"
+#include "frame-stats.h"
 #include "gpaint.h"
+#include "mipmap.h"
+#include "predictor.h"
+#include "preview.h"
+#include "stroke.h"
+#include "trace.h"
+#include "view.h"
 #include "tools/tools.h"
 
 #include "widgets/border-widget.h"
+#include "widgets/canvas.h"
 #include "widgets/color-swap-button.h"
 #include "widgets/drag-square.h"
 #include "widgets/number-entry.h"
@@ -54,18 +62,21 @@ commit_selection (AppState *state)
   if (!state->has_selection)
     return;
 
+  mark_backup_dirty (&state->backup_manager, &state->selected_rect);
+
   cairo_t *cr = cairo_create (state->main_surface);
   cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
   cairo_set_source_surface (cr, state->selected_surface, state->selected_rect.x, state->selected_rect.y);
   cairo_paint (cr);
   cairo_destroy (cr);
+  save_backup (&state->backup_manager, state->main_surface);
+  view_invalidate (state, &state->selected_rect);
 
   // Clear temporary selection state
   g_clear_pointer (&state->selected_surface, cairo_surface_destroy);
   memset (&state->selected_rect, 0, sizeof (state->selected_rect));
   state->has_selection = FALSE;
   set_can_copy_surface (state);
-  gtk_widget_queue_draw (state->drawing_area); // TODO?
 }
 
 static inline void
@@ -82,6 +93,8 @@ clear_selection (AppState *state)
   /* cairo_paint (cr); */
   /* cairo_destroy (cr); */
 
+  view_invalidate (state, &state->selected_rect);
+
   // Clear temporary selection state
   g_clear_pointer (&state->selected_surface, cairo_surface_destroy);
   memset (&state->selected_rect, 0, sizeof (state->selected_rect));
@@ -126,11 +139,40 @@ cut_rectangle (cairo_surface_t *src, const GdkRectangle *rect, const GdkRGBA *co
   return dest;
 }
 
+static gboolean
+on_motion_tick (GtkWidget *widget, GdkFrameClock *clock, gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+
+  state->motion_tick_id = 0;
+  stroke_flush_motion (state);
+  gtk_widget_queue_draw (state->drawing_area);
+  return G_SOURCE_REMOVE;
+}
+
+// Queues the pointer position (x, y) in widget coordinates, which it had at
+// time in milliseconds, for the next frame.
+static void
+queue_motion (AppState *state, double x, double y, guint32 time)
+{
+  const int px = x / state->zoom_level;
+  const int py = y / state->zoom_level;
+
+  predictor_add (state->predictor, x / state->zoom_level, y / state->zoom_level, time);
+
+  trace_record (state->trace, state, TRACE_MOTION, px, py);
+  stroke_queue_motion (state, px, py);
+
+  if (!state->motion_tick_id)
+    state->motion_tick_id = gtk_widget_add_tick_callback (state->drawing_area, on_motion_tick, state, NULL);
+}
+
 static void
 motion_handler (GtkEventControllerMotion *ctrl, double x, double y, gpointer user_data)
 {
   AppState *state = (AppState *) user_data;
 
+  frame_stats_input (state->frame_stats);
   update_cursor_position (state, x, y);
 
   if (state->tool->type == TOOL_SELECT_RECTANGLE)
@@ -160,38 +202,24 @@ motion_handler (GtkEventControllerMotion *ctrl, double x, double y, gpointer use
   if (!state->is_drawing)
     return;
 
-  int px = x / state->zoom_level;
-  int py = y / state->zoom_level;
+  // GTK merges the motion events of a frame into one, keeping the others in
+  // its history. Their positions are relative to the surface, not the widget.
+  GdkEvent *event = gtk_event_controller_get_current_event (GTK_EVENT_CONTROLLER (ctrl));
+  double event_x, event_y;
 
-  if (state->preview_surface)
+  if (event && gdk_event_get_event_type (event) == GDK_MOTION_NOTIFY && gdk_event_get_position (event, &event_x, &event_y))
     {
-      cairo_t *cr = cairo_create (state->preview_surface);
+      guint n_history = 0;
+      GdkTimeCoord *history = gdk_event_get_history (event, &n_history);
 
-      if (!state->tool->motion_handler)
-        cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+      for (guint i = 0; i < n_history; i++)
+        if ((history[i].flags & (GDK_AXIS_FLAG_X | GDK_AXIS_FLAG_Y)) == (GDK_AXIS_FLAG_X | GDK_AXIS_FLAG_Y))
+          queue_motion (state, history[i].axes[GDK_AXIS_X] + x - event_x, history[i].axes[GDK_AXIS_Y] + y - event_y, history[i].time);
 
-      // TODO
-      /* if (!g_variant_get_boolean (g_action_get_state
-       * (state->antialiasing_action))) */
-      /*   cairo_set_antialias (cr, CAIRO_ANTIALIAS_NONE); */
-      /* else */
-      /*   cairo_set_antialias(cr, CAIRO_ANTIALIAS_DEFAULT); */
-
-      cairo_set_source_rgba (cr, 0, 0, 0, 0);
-      cairo_paint (cr);
-      // Let the tool draw its preview into preview_surface:
-      if (!state->tool->motion_handler)
-        state->tool->draw_handler (state, state->start_point.x, state->start_point.y, px, py);
-      else
-        {
-          cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
-          state->tool->motion_handler (state, px, py);
-        }
-
-      cairo_destroy (cr);
+      g_free (history);
     }
 
-  gtk_widget_queue_draw (state->drawing_area);
+  queue_motion (state, x, y, event ? gdk_event_get_time (event) : (guint32) (g_get_monotonic_time () / 1000));
 }
 
 static void
@@ -215,19 +243,57 @@ static void
 on_undo (GSimpleAction *action, GVariant *parameter, gpointer user_data)
 {
   AppState *state = (AppState *) user_data;
+  trace_record (state->trace, state, TRACE_UNDO, 0, 0);
   move_backward (&state->backup_manager, state);
-  gtk_widget_queue_draw (state->drawing_area);
+  view_invalidate (state, NULL);
 }
 static void
 on_redo (GSimpleAction *action, GVariant *parameter, gpointer user_data)
 {
   AppState *state = (AppState *) user_data;
+  trace_record (state->trace, state, TRACE_REDO, 0, 0);
   move_forward (&state->backup_manager, state);
-  gtk_widget_queue_draw (state->drawing_area);
+  view_invalidate (state, NULL);
 }
 static void on_resize (GSimpleAction *action, GVariant *parameter, gpointer user_data);
 static void on_new_create (GSimpleAction *action, GVariant *parameter, gpointer user_data);
 
+// Shows the timings of recent frames over the canvas. They are also written
+// to the file named by GPAINT_FRAME_STATS_CSV if it is set.
+static void
+on_toggle_frame_stats (GSimpleAction *action, GVariant *parameter, gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+  g_autoptr (GVariant) current = g_action_get_state (G_ACTION (action));
+  gboolean value = !g_variant_get_boolean (current);
+
+  g_clear_pointer (&state->frame_stats, frame_stats_free);
+
+  if (value)
+    state->frame_stats = frame_stats_new (state->drawing_area, g_getenv ("GPAINT_FRAME_STATS_CSV"));
+
+  g_simple_action_set_state (action, g_variant_new_boolean (value));
+  gtk_widget_queue_draw (state->drawing_area);
+}
+
+// Draws the stroke ahead of the pointer to where it is predicted to be by the
+// time the frame shows. The prediction goes to the screen only.
+static void
+on_toggle_prediction (GSimpleAction *action, GVariant *parameter, gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+  g_autoptr (GVariant) current = g_action_get_state (G_ACTION (action));
+  gboolean value = !g_variant_get_boolean (current);
+
+  g_clear_pointer (&state->predictor, predictor_free);
+
+  if (value)
+    state->predictor = predictor_new ();
+
+  g_simple_action_set_state (action, g_variant_new_boolean (value));
+  gtk_widget_queue_draw (state->drawing_area);
+}
+
 static void
 on_toggle_show_grid (GSimpleAction *action, GVariant *parameter, gpointer user_data)
 {
@@ -235,7 +301,17 @@ on_toggle_show_grid (GSimpleAction *action, GVariant *parameter, gpointer user_d
   g_autoptr (GVariant) current = g_action_get_state (G_ACTION (action));
   gboolean value = g_variant_get_boolean (current);
   g_simple_action_set_state (action, g_variant_new_boolean (!value));
-  gtk_widget_queue_draw (state->drawing_area);
+  view_invalidate (state, NULL);
+}
+
+static void
+on_toggle_fill_global (GSimpleAction *action, GVariant *parameter, gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+  g_autoptr (GVariant) current = g_action_get_state (G_ACTION (action));
+  gboolean value = g_variant_get_boolean (current);
+  g_simple_action_set_state (action, g_variant_new_boolean (!value));
+  state->fill_global = !value;
 }
 
 /* static void */
@@ -491,9 +567,13 @@ on_image_surface_ready (cairo_surface_t *surface, gpointer user_data)
       /*         cairo_image_surface_get_width(surface), */
       /*         cairo_image_surface_get_height(surface)); */
 
-      // Now you can use the surface in your app
+      // Now you can use the surface in your app. A new image may land on
+      // the same rect as the old one, so both are invalidated explicitly.
       if (state->selected_surface)
-        cairo_surface_destroy (state->selected_surface);
+        {
+          view_invalidate (state, &state->selected_rect);
+          cairo_surface_destroy (state->selected_surface);
+        }
 
       state->selected_surface = surface;
       state->selected_rect = (GdkRectangle) {
@@ -505,7 +585,7 @@ on_image_surface_ready (cairo_surface_t *surface, gpointer user_data)
       state->has_selection = TRUE;
       set_can_copy_surface (state);
       tool_select (state, TOOL_SELECT_RECTANGLE);
-      gtk_widget_queue_draw (state->drawing_area);
+      view_invalidate (state, &state->selected_rect);
 
       /* cairo_surface_write_to_png(surface, "clipboard_image.png"); */
       /* cairo_surface_destroy(surface); */
@@ -612,15 +692,20 @@ on_selectall (GSimpleAction *action, GVariant *parameter, gpointer user_data)
     commit_selection (state);
 
   tool_select (state, TOOL_SELECT_RECTANGLE);
-  gtk_widget_queue_draw (state->drawing_area);
 
   if (state->selected_surface)
-    g_clear_pointer (&state->selected_surface, cairo_surface_destroy);
+    {
+      view_invalidate (state, &state->selected_rect);
+      g_clear_pointer (&state->selected_surface, cairo_surface_destroy);
+    }
 
   state->selected_rect.x = state->selected_rect.y = 0;
   state->selected_rect.width = cairo_image_surface_get_width (state->main_surface);
   state->selected_rect.height = cairo_image_surface_get_height (state->main_surface);
+  mark_backup_dirty (&state->backup_manager, &state->selected_rect);
   state->selected_surface = cut_rectangle (state->main_surface, &state->selected_rect, state->s_color);
+  save_backup (&state->backup_manager, state->main_surface);
+  view_invalidate (state, &state->selected_rect);
   state->has_selection = TRUE;
   set_can_copy_surface (state);
 }
@@ -666,10 +751,14 @@ static const GActionEntry edit_actions[] = {
   { "selectall", on_selectall, NULL, NULL, NULL },
 
   { "resize",    on_resize,    NULL, NULL, NULL },
+
+  { "fillglobal", on_toggle_fill_global, NULL, "false", NULL },
 };
 
 static const GActionEntry view_actions[] = {
   { "showgrid",  on_toggle_show_grid, NULL, "false", NULL },
+  { "framestats", on_toggle_frame_stats, NULL, "false", NULL },
+  { "prediction", on_toggle_prediction, NULL, "false", NULL },
   // TODO
   /* { "antialiasing", on_toggle_antialiasing, NULL, "false", NULL }, */
 
@@ -768,120 +857,97 @@ my_get_visible_rect (AppState *state, double *x, double *y, double *width, doubl
 }
 ///
 
+// Pattern of the main surface for cr. Zoomed out, it comes from the mipmap
+// level closest to the scale cr draws at.
+static cairo_pattern_t *
+create_main_pattern (AppState *state, cairo_t *cr)
+{
+  double scale = 1.0, unused = 0.0;
+  cairo_matrix_t matrix;
+  int level;
+
+  cairo_user_to_device_distance (cr, &scale, &unused);
+
+  cairo_surface_t *source = mipmap_get (state, fabs (scale), &level);
+  cairo_pattern_t *pattern = cairo_pattern_create_for_surface (source);
+  cairo_pattern_set_filter (pattern, CAIRO_FILTER_NEAREST);
+  cairo_matrix_init_scale (&matrix, 1.0 / (1 << level), 1.0 / (1 << level));
+  cairo_pattern_set_matrix (pattern, &matrix);
+  return pattern;
+}
+
+// Composites the main surface, the preview and the floating selection. cr is
+// in canvas coordinates.
 static void
-draw_callback (GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointer user_data)
+draw_layers (AppState *state, cairo_t *cr)
 {
-  AppState *state = (AppState *) user_data;
-  const double pixel_size = state->zoom_level;
   const int surface_width = cairo_image_surface_get_width (state->main_surface);
   const int surface_height = cairo_image_surface_get_height (state->main_surface);
   cairo_pattern_t *pattern;
-  const double bg[2] = { 0x54 / 255.0, 0xA8 / 255.0 };
-  const double line_color = (bg[0] + bg[1]) / 2.0; // TODO
-
-  double s_x, s_y, s_width, s_height;
-  my_get_visible_rect (state, &s_x, &s_y, &s_width, &s_height);
-
-  // TODO
-  const int d = 2 * max_double (8.0, pixel_size); // TODO: Preserve some space for if drawing
-                                                  // area scaled and not properly aligned.
-  const double r = pixel_size;
-  const GdkRectangle v =
-    {
-      .x = (int) (s_x / r) - d,
-      .y = (int) (s_y / r) - d,
-      .width = (int) (s_width / r) + 2 * d,
-      .height = (int) (s_height / r) + 2 * d,
-    };
-
-  // draw_transparent_square (cr, v.x, v.y, v.width, v.height, 1.0);
-
-  cairo_save (cr);
-  cairo_scale (cr, pixel_size, pixel_size);
-  // TODO use draw_transparent_square
-  double color = (pixel_size > 4.0) ? bg[1] : (bg[0] + bg[1]) / 2.0;
-  cairo_set_source_rgb (cr, color, color, color);
-  cairo_rectangle (cr, v.x, v.y, v.width, v.height);
-  cairo_fill (cr);
-  cairo_restore (cr);
 
-  // TODO. Kinda slow
-  if (pixel_size > 4.0)
-    {
-      /* Draw checkerboard background */
-      cairo_save (cr);
-      int k = (int) log2 (pixel_size); // TODO make it adaptive for zoom.
-      cairo_scale (cr, pixel_size / k, pixel_size / k);
-
-      int grid_width = (v.x + v.width) * k;
-      int grid_height = (v.y + v.height) * k;
-
-      cairo_new_path (cr);
-      const double dash[] = { 1.0, 1.0 };
-      cairo_set_dash (cr, dash, 1, 0);
-      cairo_set_line_width (cr, 1.0);
-
-      for (int y = v.y * k; y < grid_height; y++)
-        {
-          double x0, x1, y0, y1;
-
-          x0 = v.x * k + (y & 1);
-          x1 = grid_width;
-          y0 = y1 = y + 0.5;
-
-          cairo_move_to (cr, x0, y0);
-          cairo_line_to (cr, x1, y1);
-        }
-
-      cairo_set_source_rgb (cr, bg[0], bg[0], bg[0]);
-      cairo_stroke (cr);
-      cairo_restore (cr);
-    }
+  // A preview which overrides the main surface replaces it where the main
+  // surface was copied into the preview.
+  const gboolean overridden = state->preview_surface && state->tool->override_main_surface;
+  gint64 start = frame_stats_now (state->frame_stats);
 
   // VERY IMPORTANT! IT DRAWS EVERY PIXEL WITH HARD EDGES
   // Draw main content with nearest-neighbor filtering (hard-edged pixels)
-  if ((!state->is_drawing || !state->tool->override_main_surface) && !state->selected_surface)
+  if (!state->selected_surface)
     {
       cairo_save (cr);
-      cairo_scale (cr, pixel_size, pixel_size);
 
-      pattern = cairo_pattern_create_for_surface (state->main_surface);
-      cairo_pattern_set_filter (pattern, CAIRO_FILTER_NEAREST);
+      pattern = create_main_pattern (state, cr);
       cairo_set_source (cr, pattern);
 
-      cairo_rectangle (cr, v.x, v.y, v.width, v.height);
-      cairo_clip (cr);
+      if (overridden && !cairo_region_is_empty (state->preview_copied))
+        {
+          cairo_set_fill_rule (cr, CAIRO_FILL_RULE_EVEN_ODD);
+          cairo_rectangle (cr, 0, 0, surface_width, surface_height);
+          gdk_cairo_region (cr, state->preview_copied);
+          cairo_clip (cr);
+        }
 
       cairo_paint (cr);
       cairo_pattern_destroy (pattern);
       cairo_restore (cr);
     }
 
+  frame_stats_add (state->frame_stats, FRAME_STAGE_MAIN, start);
+  start = frame_stats_now (state->frame_stats);
+
   // TODO
   // Overlay preview layer if available:
-  if (state->preview_surface)
+  GdkRectangle stroke;
+
+  if (overridden || (state->preview_surface && stroke_get_rect (state, &stroke)))
     {
       cairo_save (cr);
       // TODO cairo_set_antialias (cr, CAIRO_ANTIALIAS_NONE);
-      cairo_scale (cr, pixel_size, pixel_size);
       pattern = cairo_pattern_create_for_surface (state->preview_surface);
       cairo_pattern_set_filter (pattern, CAIRO_FILTER_NEAREST); // TODO
       cairo_set_source (cr, pattern);
-      cairo_rectangle (cr, v.x, v.y, v.width, v.height);
+
+      if (overridden)
+        gdk_cairo_region (cr, state->preview_copied);
+      else
+        gdk_cairo_rectangle (cr, &stroke);
+
       cairo_clip (cr);
+
       // cairo_set_source_surface(cr, state->preview_surface, 0, 0);
       cairo_paint (cr);
       cairo_pattern_destroy (pattern);
       cairo_restore (cr);
     }
 
+  frame_stats_add (state->frame_stats, FRAME_STAGE_PREVIEW, start);
+  start = frame_stats_now (state->frame_stats);
+
   // TODO
   if (state->selected_surface)
     {
       cairo_save (cr);
-      cairo_scale (cr, pixel_size, pixel_size);
-      pattern = cairo_pattern_create_for_surface (state->main_surface);
-      cairo_pattern_set_filter (pattern, CAIRO_FILTER_NEAREST);
+      pattern = create_main_pattern (state, cr);
       cairo_set_source (cr, pattern);
       cairo_paint (cr);
       cairo_pattern_destroy (pattern);
@@ -904,38 +970,207 @@ draw_callback (GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointe
       cairo_restore (cr);
     }
 
+  frame_stats_add (state->frame_stats, FRAME_STAGE_SELECTION, start);
+}
+
+// Composites the canvas layers below the overlays.
+static void
+draw_canvas (AppState *state, cairo_t *cr)
+{
+  const double pixel_size = state->zoom_level;
+  const int surface_width = cairo_image_surface_get_width (state->main_surface);
+  const int surface_height = cairo_image_surface_get_height (state->main_surface);
+  const double bg[2] = { 0x54 / 255.0, 0xA8 / 255.0 };
+  const double line_color = (bg[0] + bg[1]) / 2.0; // TODO
+
+  double s_x, s_y, s_width, s_height;
+  my_get_visible_rect (state, &s_x, &s_y, &s_width, &s_height);
+
+  // TODO
+  const int d = 2 * max_double (8.0, pixel_size); // TODO: Preserve some space for if drawing
+                                                  // area scaled and not properly aligned.
+  const double r = pixel_size;
+  const GdkRectangle v =
+    {
+      .x = (int) (s_x / r) - d,
+      .y = (int) (s_y / r) - d,
+      .width = (int) (s_width / r) + 2 * d,
+      .height = (int) (s_height / r) + 2 * d,
+    };
+
+  gint64 start = frame_stats_now (state->frame_stats);
+
+  cairo_save (cr);
+  cairo_rectangle (cr, v.x * r, v.y * r, v.width * r, v.height * r);
+
+  if (pixel_size > 4.0)
+    {
+      // The checkerboard comes from a cached tile, so its cost does not
+      // depend on the zoom level.
+      gpaint_cairo_set_source_checkerboard (cr, gpaint_checkerboard_cell (pixel_size), 0.0, 0.0);
+    }
+  else
+    cairo_set_source_rgb (cr, line_color, line_color, line_color);
+
+  cairo_fill (cr);
+  cairo_restore (cr);
+  frame_stats_add (state->frame_stats, FRAME_STAGE_BACKGROUND, start);
+
+  cairo_save (cr);
+  cairo_scale (cr, pixel_size, pixel_size);
+  cairo_rectangle (cr, v.x, v.y, v.width, v.height);
+  cairo_clip (cr);
+  draw_layers (state, cr);
+  cairo_restore (cr);
+
   if (g_variant_get_boolean (g_action_get_state (state->show_grid_action)) && pixel_size >= 4.0)
     {
+      start = frame_stats_now (state->frame_stats);
       cairo_save (cr);
 
-      double t = line_color;
-      cairo_set_source_rgb (cr, t, t, t);
-      cairo_set_line_width (cr, 1.0);
-
-      // TODO cairo_set_antialias (cr, CAIRO_ANTIALIAS_NONE);
-      cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-      cairo_set_line_cap (cr, CAIRO_LINE_CAP_SQUARE);
-      cairo_set_line_join (cr, CAIRO_LINE_JOIN_MITER);
+      // Only the visible part of the grid is filled, from a cached tile.
+      const int x0 = max_int (v.x, 0);
+      const int y0 = max_int (v.y, 0);
+      const int x1 = min_int (v.x + v.width, surface_width);
+      const int y1 = min_int (v.y + v.height, surface_height);
 
-      // Draw vertical grid lines
-      for (int x = 0; x <= surface_width; x++)
+      if (x0 <= x1 && y0 <= y1)
         {
-          cairo_move_to (cr, x * pixel_size, 0);
-          cairo_line_to (cr, x * pixel_size, surface_height * pixel_size);
+          gpaint_cairo_set_source_grid (cr, pixel_size, line_color);
+          cairo_rectangle (cr, x0 * pixel_size - 0.5, y0 * pixel_size - 0.5, (x1 - x0) * pixel_size + 1.0, (y1 - y0) * pixel_size + 1.0);
+          cairo_fill (cr);
         }
 
-      // Draw horizontal grid lines
-      for (int y = 0; y <= surface_height; y++)
+      cairo_restore (cr);
+      frame_stats_add (state->frame_stats, FRAME_STAGE_GRID, start);
+    }
+}
+
+#if GTK_CHECK_VERSION (4, 10, 0)
+static void
+snapshot_callback (GpaintCanvas *canvas, GtkSnapshot *snapshot, gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+
+  frame_stats_begin_frame (state->frame_stats);
+  tool_flush_lines (state);
+  view_snapshot (state, snapshot, draw_layers);
+}
+#endif
+
+static gboolean
+on_predicted_tail_stale (gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+
+  state->predictor_timeout_id = 0;
+  gtk_widget_queue_draw (state->drawing_area);
+  return G_SOURCE_REMOVE;
+}
+
+// Draws the stroke from its last point to where the pointer is predicted to
+// be one frame later, on the screen only. Real motion replaces it on the next
+// frame; if none comes, it is removed once the prediction goes stale.
+static void
+draw_predicted_tail (AppState *state, cairo_t *cr)
+{
+  GdkFrameClock *clock = gtk_widget_get_frame_clock (state->drawing_area);
+  const GdkRGBA *color = state->p_color;
+  gint64 lead = G_USEC_PER_SEC / 60;
+  Point points[2 * SYMMETRY_MAX_COPIES];
+  guint count = 2;
+  double width;
+  double x, y;
+
+  if (!state->predictor || !state->is_drawing || !state->preview_surface)
+    return;
+
+  switch (state->tool->type)
+    {
+    case TOOL_FREEHAND:
+    case TOOL_SYMMETRIC_FREEHAND:
+      width = 1.0;
+      break;
+    case TOOL_BRUSH:
+      width = 0.0; // Dabs are drawn instead of a line
+      break;
+    case TOOL_ERASER:
+      width = state->eraser_size;
+      color = eraser_get_color (state);
+      break;
+    default:
+      return;
+    }
+
+  if (clock)
+    gdk_frame_clock_get_refresh_info (clock, gdk_frame_clock_get_frame_time (clock), &lead, NULL);
+
+  if (!predictor_predict (state->predictor, lead, &x, &y))
+    return;
+
+  // The tail goes through the same copies as the stroke itself.
+  if (state->tool->type == TOOL_SYMMETRIC_FREEHAND)
+    count = symmetric_segments (state, state->last_point.x, state->last_point.y, (gint) floor (x), (gint) floor (y), points);
+  else
+    {
+      points[0] = state->last_point;
+      points[1] = (Point) { (gint) floor (x), (gint) floor (y) };
+    }
+
+  cairo_save (cr);
+  cairo_scale (cr, state->zoom_level, state->zoom_level);
+
+  // The brush shows the very dabs it is going to stamp, in its shape and
+  // softness.
+  if (state->tool->type == TOOL_BRUSH)
+    brush_draw_tail (state, cr, points[1].x, points[1].y);
+  else
+    {
+      cairo_set_antialias (cr, state->antialiasing);
+      cairo_set_line_width (cr, width);
+      cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
+      gdk_cairo_set_source_rgba (cr, color);
+
+      for (guint i = 0; i + 1 < count; i += 2)
         {
-          cairo_move_to (cr, 0, y * pixel_size);
-          cairo_line_to (cr, surface_width * pixel_size, y * pixel_size);
+          cairo_move_to (cr, points[i].x + 0.5, points[i].y + 0.5);
+          cairo_line_to (cr, points[i + 1].x + 0.5, points[i + 1].y + 0.5);
         }
 
-      // Stroke the lines to render them
       cairo_stroke (cr);
-      cairo_restore (cr);
     }
 
+  // The eraser ends every motion with a square stamp, like its cursor.
+  if (state->tool->type == TOOL_ERASER)
+    {
+      cairo_rectangle (cr, points[1].x + 0.5 - width / 2, points[1].y + 0.5 - width / 2, width, width);
+      cairo_fill (cr);
+    }
+
+  cairo_restore (cr);
+
+  frame_stats_set_lead (state->frame_stats, lead);
+
+  if (!state->predictor_timeout_id)
+    state->predictor_timeout_id = g_timeout_add (2 * lead / 1000 + 1, on_predicted_tail_stale, state);
+}
+
+static void
+draw_callback (GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+  const double pixel_size = state->zoom_level;
+
+  tool_flush_lines (state);
+
+  if (!state->view_textured)
+    {
+      frame_stats_begin_frame (state->frame_stats);
+      view_draw (state, cr, draw_canvas);
+    }
+
+  gint64 start = frame_stats_now (state->frame_stats);
+
   if (state->tool->type == TOOL_SELECT_RECTANGLE)
     {
       cairo_save (cr);
@@ -961,6 +1196,9 @@ draw_callback (GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointe
       cairo_restore (cr);
     }
 
+  frame_stats_add (state->frame_stats, FRAME_STAGE_SELECTION, start);
+  draw_predicted_tail (state, cr);
+
   /* if (state->tool->type == TOOL_SELECT_RECTANGLE) */
   /*   { */
   /*     cairo_save (cr); */
@@ -1018,6 +1256,8 @@ draw_callback (GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointe
 
   // TODO
   // Overlay cursor layer if available:
+  start = frame_stats_now (state->frame_stats);
+
   if (state->tool->draw_cursor_handler && state->cursor_x >= 0.0 && state->cursor_y >= 0.0)
     {
       cairo_save (cr);
@@ -1025,6 +1265,10 @@ draw_callback (GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointe
       cairo_restore (cr);
     }
 
+  frame_stats_add (state->frame_stats, FRAME_STAGE_CURSOR, start);
+  frame_stats_end_frame (state->frame_stats);
+  frame_stats_draw (state->frame_stats, cr, gtk_adjustment_get_value (state->hadj) + 8.0, gtk_adjustment_get_value (state->vadj) + 8.0);
+
   // TODO Drawing border...
   /* cairo_save (cr); */
   /* cairo_set_source_rgb (cr, 0.0, 0.0, 0.0); */
@@ -1080,6 +1324,8 @@ on_click_pressed (GtkGestureDrag *gesture, double x, double y, gpointer user_dat
   int px = (int) (x / state->zoom_level);
   int py = (int) (y / state->zoom_level);
 
+  frame_stats_input (state->frame_stats);
+
   if (state->has_selection)
     update_cursor (state);
 
@@ -1097,50 +1343,30 @@ on_click_pressed (GtkGestureDrag *gesture, double x, double y, gpointer user_dat
   if (state->has_selection)
     commit_selection (state);
 
-  if (state->is_drawing && state->preview_surface)
+  // Ctrl+click moves the centre of symmetry rather than drawing.
+  if (state->tool->type == TOOL_SYMMETRIC_FREEHAND && !state->is_drawing
+      && gtk_event_controller_get_current_event_state (GTK_EVENT_CONTROLLER (gesture)) & GDK_CONTROL_MASK)
     {
-      g_clear_pointer (&state->preview_surface, cairo_surface_destroy);
-      state->is_drawing = FALSE;
+      state->symmetry_offset_x = px + 0.5 - cairo_image_surface_get_width (state->main_surface) / 2.0;
+      state->symmetry_offset_y = py + 0.5 - cairo_image_surface_get_height (state->main_surface) / 2.0;
       gtk_widget_queue_draw (state->drawing_area);
       return;
     }
 
-  if (state->tool->drag_begin)
-    state->tool->drag_begin (state);
-
-  state->is_drawing = TRUE;
-  state->start_point.x = px;
-  state->start_point.y = py;
-  state->last_point = state->start_point;
-  state->p_color = p_color;
-  state->s_color = s_color;
-
-  if (state->preview_surface)
-    g_clear_pointer (&state->preview_surface, cairo_surface_destroy);
-
-  state->preview_surface = create_surface (cairo_image_surface_get_width (state->main_surface), cairo_image_surface_get_height (state->main_surface));
-
-  if (state->tool->override_main_surface)
-    copy_surface (state->preview_surface, state->main_surface);
-
-  // TODO
-  /* [TOOL_LINE]             	= { "Line", &global_line_tool }, */
-  /* [TOOL_RECTANGLE]        	= { "Rect", &global_rectangle_tool }, */
-  /* [TOOL_ELLIPSE]          	= { "Ellipse", &global_ellipse_tool }, */
-  /* [TOOL_SELECT_RECTANGLE] 	= { "Select rectangle",
-   * &global_select_rectangle_tool }, */
-  /* [TOOL_DRAG]             	= { "Drag", &global_drag_tool }, */
-
-  if (state->tool->type == TOOL_BRUSH
-      || state->tool->type == TOOL_BUCKET
-      || state->tool->type == TOOL_ERASER
-      || state->tool->type == TOOL_PICKER
-      || state->tool->type == TOOL_SYMMETRIC_FREEHAND
-      || state->tool->type == TOOL_FREEHAND) // TODO
+  if (state->is_drawing && state->preview_surface)
     {
-      state->tool->draw_handler (state, px, py, px, py);
+      trace_record (state->trace, state, TRACE_CANCEL, px, py);
+      stroke_cancel (state);
       gtk_widget_queue_draw (state->drawing_area);
+      return;
     }
+
+  predictor_reset (state->predictor);
+  state->p_color = p_color;
+  state->s_color = s_color;
+  trace_record (state->trace, state, TRACE_PRESS, px, py);
+  stroke_begin (state, px, py);
+  gtk_widget_queue_draw (state->drawing_area);
 }
 
 static void
@@ -1149,6 +1375,7 @@ on_click_released (GtkGestureDrag *gesture, double x, double y, gpointer user_da
   AppState *state = (AppState *) user_data;
 
   state->is_dragging_selection = FALSE;
+  predictor_reset (state->predictor);
 
   if (state->has_selection)
     update_cursor (state);
@@ -1167,26 +1394,21 @@ on_click_released (GtkGestureDrag *gesture, double x, double y, gpointer user_da
       if (state->selected_surface)
         g_clear_pointer (&state->selected_surface, cairo_surface_destroy);
 
-      save_backup (&state->backup_manager, state->main_surface);
+      mark_backup_dirty (&state->backup_manager, &state->selected_rect);
       state->selected_surface = cut_rectangle (state->main_surface, &state->selected_rect, state->s_color);
+      save_backup (&state->backup_manager, state->main_surface);
+      view_invalidate (state, &state->selected_rect);
       state->has_selection = TRUE;
       set_can_copy_surface (state);
     }
   else if (state->selected_surface)
-    g_clear_pointer (&state->selected_surface, cairo_surface_destroy);
-
-  if (state->preview_surface)
     {
-      save_backup (&state->backup_manager, state->main_surface);
-
-      cairo_t *cr = create_cairo (state->main_surface, state->tool->override_main_surface ? CAIRO_OPERATOR_SOURCE : CAIRO_OPERATOR_OVER, state->antialiasing);
-      cairo_set_source_surface (cr, state->preview_surface, 0, 0);
-      cairo_paint (cr);
-      cairo_destroy (cr);
-      g_clear_pointer (&state->preview_surface, cairo_surface_destroy);
+      view_invalidate (state, &state->selected_rect);
+      g_clear_pointer (&state->selected_surface, cairo_surface_destroy);
     }
 
-  state->is_drawing = FALSE;
+  trace_record (state->trace, state, TRACE_RELEASE, (int) (x / state->zoom_level), (int) (y / state->zoom_level));
+  stroke_end (state);
 
   /// TODO
   // gtk_widget_queue_draw (gpaint_layers_widget_get_selected_button
@@ -1414,14 +1636,16 @@ on_open_response (GObject *source_object, GAsyncResult *res, gpointer user_data)
   if (state->main_surface)
     g_clear_pointer (&state->main_surface, cairo_surface_destroy);
 
+  mark_backup_dirty (&state->backup_manager, NULL);
   state->main_surface = new_surface;
+  save_backup (&state->backup_manager, state->main_surface);
 
   /* Update the drawing area size */
   gtk_drawing_area_set_content_width (GTK_DRAWING_AREA (state->drawing_area), (int) (width * state->zoom_level));
   gtk_drawing_area_set_content_height (GTK_DRAWING_AREA (state->drawing_area), (int) (height * state->zoom_level));
 
   /* Request a redraw */
-  gtk_widget_queue_draw (state->drawing_area);
+  view_invalidate (state, NULL);
 }
 
 // Change the on_open_file function to use the modern GTK4 file dialog:
@@ -1533,7 +1757,7 @@ static void
 draw_colored_square0 (GtkDrawingArea *area, cairo_t *cr, gint width, gint height, gpointer user_data)
 {
   const GdkRGBA *color = (const GdkRGBA *) user_data;
-  draw_colored_square (cr, color, 0, 0, width, height, 8.0);
+  draw_colored_square (cr, color, 0, 0, width, height);
   /* const GdkRGBA border = { 0.0, 0.0, 0.0, 1.0 }; */
   /* const gdouble border_width = 1.0; */
   /* cairo_save (cr); */
@@ -1742,8 +1966,10 @@ static void
 on_new_file (GSimpleAction *action, GVariant *parameter, gpointer user_data)
 {
   AppState *state = (AppState *) user_data;
+  mark_backup_dirty (&state->backup_manager, NULL);
   clear_canvas (state->main_surface);
-  gtk_widget_queue_draw (state->drawing_area);
+  save_backup (&state->backup_manager, state->main_surface);
+  view_invalidate (state, NULL);
 }
 
 /* static GtkWidget * */
@@ -1796,6 +2022,162 @@ create_file_toolbar (AppState *state)
   return file_btn;
 }
 
+// Largest difference of any channel from the clicked pixel which the bucket
+// still fills.
+static const struct
+{
+  const char *label;
+  gint value;
+} fill_tolerances[] =
+  {
+    { "Exact match",      0  },
+    { "Low tolerance",    16 },
+    { "Medium tolerance", 48 },
+    { "High tolerance",   96 },
+  };
+
+static void
+on_fill_tolerance_changed (GSimpleAction *action, GVariant *value, gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+  g_simple_action_set_state (action, value);
+  state->fill_tolerance = (guint) g_variant_get_int32 (value);
+}
+
+static void
+setup_fill_tolerance_action (AppState *state)
+{
+  GSimpleAction *action = g_simple_action_new_stateful ("filltolerance",
+                                                        G_VARIANT_TYPE_INT32,
+                                                        g_variant_new_int32 (fill_tolerances[0].value));
+  g_signal_connect (action, "change-state", G_CALLBACK (on_fill_tolerance_changed), state);
+  g_action_map_add_action (G_ACTION_MAP (state->application), G_ACTION (action));
+}
+
+static const struct
+{
+  const char *label;
+  const char *key;
+  BrushShape shape;
+} brush_shapes[] =
+  {
+    { "Round",  "round",  BRUSH_SHAPE_ROUND  },
+    { "Square", "square", BRUSH_SHAPE_SQUARE },
+  };
+
+// Part of the brush radius, in percent, over which the dab fades out.
+static const struct
+{
+  const char *label;
+  gint value;
+} brush_softnesses[] =
+  {
+    { "Hard edge",   0   },
+    { "Soft edge",   30  },
+    { "Softer edge", 60  },
+    { "Feathered",   100 },
+  };
+
+static void
+on_brush_shape_changed (GSimpleAction *action, GVariant *value, gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+  const gchar *key = g_variant_get_string (value, NULL);
+
+  g_simple_action_set_state (action, value);
+
+  for (size_t i = 0; i < countof (brush_shapes); i++)
+    if (g_strcmp0 (brush_shapes[i].key, key) == 0)
+      state->brush_shape = brush_shapes[i].shape;
+}
+
+static void
+on_brush_softness_changed (GSimpleAction *action, GVariant *value, gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+  g_simple_action_set_state (action, value);
+  state->brush_softness = g_variant_get_int32 (value) / 100.0;
+}
+
+static void
+setup_brush_actions (AppState *state)
+{
+  GSimpleAction *action = g_simple_action_new_stateful ("brushshape",
+                                                        G_VARIANT_TYPE_STRING,
+                                                        g_variant_new_string (brush_shapes[0].key));
+  g_signal_connect (action, "change-state", G_CALLBACK (on_brush_shape_changed), state);
+  g_action_map_add_action (G_ACTION_MAP (state->application), G_ACTION (action));
+
+  action = g_simple_action_new_stateful ("brushsoftness",
+                                         G_VARIANT_TYPE_INT32,
+                                         g_variant_new_int32 (brush_softnesses[0].value));
+  g_signal_connect (action, "change-state", G_CALLBACK (on_brush_softness_changed), state);
+  g_action_map_add_action (G_ACTION_MAP (state->application), G_ACTION (action));
+}
+
+static const struct
+{
+  const char *label;
+  const char *key;
+  SymmetryMode mode;
+  guint folds;
+} symmetry_modes[] =
+  {
+    { "Point",                 "radial-2",  SYMMETRY_RADIAL, 2  },
+    { "Mirror left and right", "x",         SYMMETRY_X,      0  },
+    { "Mirror top and bottom", "y",         SYMMETRY_Y,      0  },
+    { "Mirror both ways",      "xy",        SYMMETRY_XY,     0  },
+    { "3-fold",                "radial-3",  SYMMETRY_RADIAL, 3  },
+    { "4-fold",                "radial-4",  SYMMETRY_RADIAL, 4  },
+    { "6-fold",                "radial-6",  SYMMETRY_RADIAL, 6  },
+    { "8-fold",                "radial-8",  SYMMETRY_RADIAL, 8  },
+    { "12-fold",               "radial-12", SYMMETRY_RADIAL, 12 },
+    { "16-fold",               "radial-16", SYMMETRY_RADIAL, 16 },
+    { "32-fold",               "radial-32", SYMMETRY_RADIAL, 32 },
+  };
+
+static void
+on_symmetry_changed (GSimpleAction *action, GVariant *value, gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+  const gchar *key = g_variant_get_string (value, NULL);
+
+  g_simple_action_set_state (action, value);
+
+  for (size_t i = 0; i < countof (symmetry_modes); i++)
+    if (g_strcmp0 (symmetry_modes[i].key, key) == 0)
+      {
+        state->symmetry_mode = symmetry_modes[i].mode;
+        state->symmetry_folds = symmetry_modes[i].folds;
+      }
+
+  gtk_widget_queue_draw (state->drawing_area);
+}
+
+// Puts the centre of symmetry back in the middle of the canvas.
+static void
+on_symmetry_reset (GSimpleAction *action, GVariant *parameter, gpointer user_data)
+{
+  AppState *state = (AppState *) user_data;
+
+  state->symmetry_offset_x = state->symmetry_offset_y = 0.0;
+  gtk_widget_queue_draw (state->drawing_area);
+}
+
+static void
+setup_symmetry_action (AppState *state)
+{
+  GSimpleAction *action = g_simple_action_new_stateful ("symmetry",
+                                                        G_VARIANT_TYPE_STRING,
+                                                        g_variant_new_string (symmetry_modes[0].key));
+  g_signal_connect (action, "change-state", G_CALLBACK (on_symmetry_changed), state);
+  g_action_map_add_action (G_ACTION_MAP (state->application), G_ACTION (action));
+
+  action = g_simple_action_new ("symmetryreset", NULL);
+  g_signal_connect (action, "activate", G_CALLBACK (on_symmetry_reset), state);
+  g_action_map_add_action (G_ACTION_MAP (state->application), G_ACTION (action));
+}
+
 static GtkWidget *
 create_edit_toolbar (AppState *state)
 {
@@ -1811,6 +2193,52 @@ create_edit_toolbar (AppState *state)
 
   g_menu_append (edit, "Resize", "app.resize");
 
+  g_autoptr (GMenu) fill_menu = g_menu_new ();
+  g_menu_append (fill_menu, "Fill all matching pixels", "app.fillglobal");
+
+  for (size_t i = 0; i < countof (fill_tolerances); i++)
+    {
+      g_autoptr (GMenuItem) item = g_menu_item_new (fill_tolerances[i].label, "app.filltolerance");
+      g_menu_item_set_attribute_value (item, "target", g_variant_new_int32 (fill_tolerances[i].value));
+      g_menu_append_item (fill_menu, item);
+    }
+
+  g_menu_append_submenu (edit, "Bucket fill", G_MENU_MODEL (fill_menu));
+
+  g_autoptr (GMenu) brush_menu = g_menu_new ();
+  g_autoptr (GMenu) brush_shape_section = g_menu_new ();
+  g_autoptr (GMenu) brush_softness_section = g_menu_new ();
+
+  for (size_t i = 0; i < countof (brush_shapes); i++)
+    {
+      g_autoptr (GMenuItem) item = g_menu_item_new (brush_shapes[i].label, "app.brushshape");
+      g_menu_item_set_attribute_value (item, "target", g_variant_new_string (brush_shapes[i].key));
+      g_menu_append_item (brush_shape_section, item);
+    }
+
+  for (size_t i = 0; i < countof (brush_softnesses); i++)
+    {
+      g_autoptr (GMenuItem) item = g_menu_item_new (brush_softnesses[i].label, "app.brushsoftness");
+      g_menu_item_set_attribute_value (item, "target", g_variant_new_int32 (brush_softnesses[i].value));
+      g_menu_append_item (brush_softness_section, item);
+    }
+
+  g_menu_append_section (brush_menu, NULL, G_MENU_MODEL (brush_shape_section));
+  g_menu_append_section (brush_menu, NULL, G_MENU_MODEL (brush_softness_section));
+  g_menu_append_submenu (edit, "Brush", G_MENU_MODEL (brush_menu));
+
+  g_autoptr (GMenu) symmetry_menu = g_menu_new ();
+
+  for (size_t i = 0; i < countof (symmetry_modes); i++)
+    {
+      g_autoptr (GMenuItem) item = g_menu_item_new (symmetry_modes[i].label, "app.symmetry");
+      g_menu_item_set_attribute_value (item, "target", g_variant_new_string (symmetry_modes[i].key));
+      g_menu_append_item (symmetry_menu, item);
+    }
+
+  g_menu_append (symmetry_menu, "Centre on canvas", "app.symmetryreset");
+  g_menu_append_submenu (edit, "Symmetry", G_MENU_MODEL (symmetry_menu));
+
   GtkWidget *edit_btn = gtk_menu_button_new ();
   gtk_menu_button_set_menu_model (GTK_MENU_BUTTON (edit_btn), G_MENU_MODEL (edit));
   gtk_menu_button_set_label (GTK_MENU_BUTTON (edit_btn), "Edit");
@@ -1863,6 +2291,8 @@ create_view_toolbar (AppState *state)
   // Create the main 'View' menu
   g_autoptr (GMenu) view_menu = g_menu_new ();
   g_menu_append (view_menu, "Show grid", "app.showgrid");
+  g_menu_append (view_menu, "Show frame timings", "app.framestats");
+  g_menu_append (view_menu, "Predict strokes", "app.prediction");
   g_menu_append (view_menu, "Enable antialiasing", "app.antialiasing");
   g_menu_append (view_menu, "Zoom in", "app.zoomin");
   g_menu_append (view_menu, "Zoom out", "app.zoomout");
@@ -1915,6 +2345,9 @@ create_menus (GtkWidget *header_bar, AppState *state)
   gtk_header_bar_pack_start (GTK_HEADER_BAR (header_bar), create_view_toolbar (state));
 
   setup_antialiasing_action (state);
+  setup_symmetry_action (state);
+  setup_fill_tolerance_action (state);
+  setup_brush_actions (state);
 }
 
 // TODO rename
@@ -1922,7 +2355,6 @@ static void
 resize_drawable_area_x (gpointer user_data, int dx, int dy, int dirx, int diry)
 {
   AppState *state = (AppState *) user_data;
-  save_backup (&state->backup_manager, state->main_surface);
   int width = cairo_image_surface_get_width (state->main_surface);
   int height = cairo_image_surface_get_height (state->main_surface);
   int new_width = width + (dx / state->zoom_level) * dirx;
@@ -1936,6 +2368,7 @@ resize_drawable_area_x (gpointer user_data, int dx, int dy, int dirx, int diry)
 
   cairo_surface_t *old_surface = state->main_surface;
 
+  mark_backup_dirty (&state->backup_manager, NULL);
   state->main_surface = cairo_image_surface_create (cairo_image_surface_get_format (old_surface), new_width, new_height);
   clear_canvas (state->main_surface);
 
@@ -1945,10 +2378,11 @@ resize_drawable_area_x (gpointer user_data, int dx, int dy, int dirx, int diry)
   cairo_destroy (cr);
 
   g_clear_pointer (&old_surface, cairo_surface_destroy);
+  save_backup (&state->backup_manager, state->main_surface);
 
   gtk_drawing_area_set_content_width (GTK_DRAWING_AREA (state->drawing_area), (int) (cairo_image_surface_get_width (state->main_surface) * state->zoom_level));
   gtk_drawing_area_set_content_height (GTK_DRAWING_AREA (state->drawing_area), (int) (cairo_image_surface_get_height (state->main_surface) * state->zoom_level));
-  gtk_widget_queue_draw (state->drawing_area);
+  view_invalidate (state, NULL);
   update_cursor_position (state, -1, -1); // TODO
 }
 
@@ -1956,10 +2390,9 @@ resize_drawable_area_x (gpointer user_data, int dx, int dy, int dirx, int diry)
 static void
 resize_drawable_area (AppState *state, int new_width, int new_height)
 {
-  save_backup (&state->backup_manager, state->main_surface);
-
   cairo_surface_t *old_surface = state->main_surface;
 
+  mark_backup_dirty (&state->backup_manager, NULL);
   state->main_surface = cairo_image_surface_create (cairo_image_surface_get_format (old_surface), new_width, new_height);
   clear_canvas (state->main_surface);
 
@@ -1969,10 +2402,11 @@ resize_drawable_area (AppState *state, int new_width, int new_height)
   cairo_destroy (cr);
 
   cairo_surface_destroy (old_surface);
+  save_backup (&state->backup_manager, state->main_surface);
 
   gtk_drawing_area_set_content_width (GTK_DRAWING_AREA (state->drawing_area), (int) (cairo_image_surface_get_width (state->main_surface) * state->zoom_level));
   gtk_drawing_area_set_content_height (GTK_DRAWING_AREA (state->drawing_area), (int) (cairo_image_surface_get_height (state->main_surface) * state->zoom_level));
-  gtk_widget_queue_draw (state->drawing_area);
+  view_invalidate (state, NULL);
 }
 
 static void on_entry_changed (GtkEditable *editable, gpointer user_data);
@@ -2336,6 +2770,7 @@ static void on_new_sprite_ok(GtkButton *button, gpointer user_data) {
     }
 
     // Create new Cairo surface (destroy old one if any)
+    mark_backup_dirty (&state->backup_manager, NULL);
     if (state->main_surface) {
         cairo_surface_destroy(state->main_surface);
     }
@@ -2358,14 +2793,14 @@ static void on_new_sprite_ok(GtkButton *button, gpointer user_data) {
     }
 
     cairo_destroy(cr);
-
+    save_backup (&state->backup_manager, state->main_surface);
 
   /* Update the drawing area size */
   gtk_drawing_area_set_content_width (GTK_DRAWING_AREA (state->drawing_area), (int) (w * state->zoom_level));
   gtk_drawing_area_set_content_height (GTK_DRAWING_AREA (state->drawing_area), (int) (h * state->zoom_level));
 
   /* Request a redraw */
-  gtk_widget_queue_draw (state->drawing_area);
+  view_invalidate (state, NULL);
     gtk_window_destroy (GTK_WINDOW (d->dialog));
    // Close the dialog
     // TODO gtk_window_destroy(GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(button))));
@@ -2381,11 +2816,20 @@ static void on_new_sprite_cancel(GtkButton *button, gpointer user_data) {
 static GtkWidget *
 create_drawing_area (AppState *state)
 {
-  GtkWidget *drawing_area = gtk_drawing_area_new ();
+  GtkWidget *drawing_area = gpaint_canvas_new ();
   gtk_drawing_area_set_content_width (GTK_DRAWING_AREA (drawing_area), (int) (cairo_image_surface_get_width (state->main_surface) * state->zoom_level));
   gtk_drawing_area_set_content_height (GTK_DRAWING_AREA (drawing_area), (int) (cairo_image_surface_get_height (state->main_surface) * state->zoom_level));
   gtk_drawing_area_set_draw_func (GTK_DRAWING_AREA (drawing_area), draw_callback, state, NULL);
 
+#if GTK_CHECK_VERSION (4, 10, 0)
+  // The canvas is kept in textures unless the cairo backing store is asked
+  // for, e.g. to compare the two.
+  state->view_textured = !g_getenv ("GPAINT_CAIRO_CANVAS");
+
+  if (state->view_textured)
+    gpaint_canvas_set_snapshot_func (GPAINT_CANVAS (drawing_area), snapshot_callback, state);
+#endif
+
   struct
   {
     void (*callback) (GtkGestureDrag *gesture, double x, double y, gpointer user_data);
@@ -2490,6 +2934,41 @@ create_gpaint_drawing_area (AppState *state)
 /*   gtk_widget_queue_draw (state->drawing_area); */
 /* } */
 
+static void
+update_history_info (BackupManager *manager, gpointer user_data)
+{
+  AppState *state = user_data;
+  gsize bytes;
+  guint entries;
+
+  get_backup_usage (manager, &bytes, &entries);
+
+  g_autofree gchar *size = g_format_size (bytes);
+  g_autofree gchar *text = g_strdup_printf ("History: %u steps, %s", entries, size);
+  gtk_label_set_text (GTK_LABEL (state->history_info), text);
+}
+
+// Memory limit of the undo history in megabytes, may be overridden with the
+// GPAINT_HISTORY_BUDGET environment variable; 0 means no limit.
+static gsize
+get_history_budget (void)
+{
+  const gchar *env = g_getenv ("GPAINT_HISTORY_BUDGET");
+
+  if (env)
+    {
+      gchar *end;
+      guint64 value = g_ascii_strtoull (env, &end, 10);
+
+      if (end != env && *end == '\0')
+        return (gsize) value;
+
+      g_warning ("Invalid GPAINT_HISTORY_BUDGET value '%s', using the default", env);
+    }
+
+  return 512;
+}
+
 static void
 activate (GtkApplication *app, AppState *state)
 {
@@ -2519,6 +2998,7 @@ activate (GtkApplication *app, AppState *state)
   state->color_swap_button = gpaint_color_swap_button_new (get_primary_color, get_secondary_color, swap_colors, state);
   state->image_info = gtk_label_new ("");
   state->current_position = gtk_label_new ("");
+  state->history_info = gtk_label_new ("");
 
   GtkColorDialog *dialog = gtk_color_dialog_new ();
   gtk_color_dialog_set_with_alpha (dialog, TRUE);
@@ -2537,6 +3017,7 @@ activate (GtkApplication *app, AppState *state)
   gtk_box_append (GTK_BOX (hbox), state->image_info);
 
   gtk_box_append (GTK_BOX (hbox), state->current_position);
+  gtk_box_append (GTK_BOX (hbox), state->history_info);
 
   state->info_widget = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
   gtk_widget_set_valign (state->info_widget, GTK_ALIGN_CENTER);
@@ -2614,6 +3095,13 @@ activate (GtkApplication *app, AppState *state)
     gtk_application_set_accels_for_action (app, app_accels[i].action, app_accels[i].accels);
 
   state->show_grid_action = g_action_map_lookup_action (G_ACTION_MAP (app), "showgrid");
+
+  if (g_getenv ("GPAINT_FRAME_STATS") || g_getenv ("GPAINT_FRAME_STATS_CSV"))
+    g_action_group_activate_action (G_ACTION_GROUP (app), "framestats", NULL);
+
+  if (g_getenv ("GPAINT_PREDICT"))
+    g_action_group_activate_action (G_ACTION_GROUP (app), "prediction", NULL);
+
   state->antialiasing_action = g_action_map_lookup_action (G_ACTION_MAP (app), "antialiasing");
 
   state->cut_action = g_action_map_lookup_action (G_ACTION_MAP (app), "cut");
@@ -2626,6 +3114,10 @@ activate (GtkApplication *app, AppState *state)
   g_simple_action_set_enabled (state->backup_manager.undo_action, !g_queue_is_empty (state->backup_manager.undo));
   g_simple_action_set_enabled (state->backup_manager.redo_action, !g_queue_is_empty (state->backup_manager.redo));
 
+  state->backup_manager.changed = update_history_info;
+  state->backup_manager.changed_data = state;
+  update_history_info (&state->backup_manager, state);
+
 #if HAVE_ADWAITA
   // TODO
   adw_style_manager_set_color_scheme(adw_style_manager_get_default(), ADW_COLOR_SCHEME_FORCE_DARK);
@@ -2675,7 +3167,15 @@ main (int argc, char **argv)
   state.tool = &global_freehand_tool;
   state.is_drawing = FALSE;
   state.preview_surface = NULL;
-  init_backup_manager (&state.backup_manager);
+  init_backup_manager (&state.backup_manager, state.main_surface);
+  set_backup_journal (&state.backup_manager, g_getenv ("GPAINT_HISTORY_JOURNAL") != NULL);
+  set_backup_budget (&state.backup_manager, get_history_budget ());
+
+  // Pointer input is recorded for replaying with gpaint-replay if
+  // GPAINT_TRACE names a file.
+  if (g_getenv ("GPAINT_TRACE"))
+    state.trace = trace_new (g_getenv ("GPAINT_TRACE"), &state);
+
   state.selected_surface = NULL;
   state.selected_rect = (GdkRectangle) { 0, 0, 0, 0 };
   state.has_selection = FALSE;
@@ -2753,6 +3253,17 @@ main (int argc, char **argv)
   g_signal_connect (app, "activate", G_CALLBACK (activate), &state);
   int status = g_application_run (G_APPLICATION (app), argc, argv);
   free_backup_manager (&state.backup_manager);
+  free_preview (&state);
+  free_view (&state);
+  free_mipmap (&state);
+  g_clear_pointer (&state.frame_stats, frame_stats_free);
+  g_clear_pointer (&state.trace, trace_free);
+  g_clear_pointer (&state.predictor, predictor_free);
+  g_clear_handle_id (&state.predictor_timeout_id, g_source_remove);
+  free_brush_masks ();
+  free_fill_pool ();
+  g_clear_pointer (&state.motion_points, g_array_unref);
+  gpaint_cairo_free_patterns ();
   /* cairo_surface_destroy (state.main_surface); */
   return status;
 }
@@ -0,0 +1,164 @@
+#include "mipmap.h"
+
+// Reduced copies of the main surface for drawing it zoomed out. Level n is
+// 2^n times smaller than the canvas, every pixel the average of a 2x2 block
+// of the level below. A level is built when it is first drawn; afterwards
+// only the parts of the canvas damaged since are filtered again.
+
+// Level whose pixels are closest to, but not smaller than, one canvas pixel
+// drawn at scale.
+int
+mipmap_level (double scale)
+{
+  int level = 0;
+
+  while (level < GPAINT_MIPMAP_LEVELS && scale <= 0.5)
+    {
+      scale *= 2.0;
+      level++;
+    }
+
+  return level;
+}
+
+// Averages the 2x2 blocks of src under area, in src pixels, into dst. Both
+// have 4 bytes per pixel. Premultiplied channels can be averaged independently.
+static void
+mipmap_reduce (cairo_surface_t *dst, cairo_surface_t *src, const GdkRectangle *area)
+{
+  const int src_width = cairo_image_surface_get_width (src);
+  const int src_height = cairo_image_surface_get_height (src);
+  const int src_stride = cairo_image_surface_get_stride (src);
+  const int dst_width = cairo_image_surface_get_width (dst);
+  const int dst_height = cairo_image_surface_get_height (dst);
+  const int dst_stride = cairo_image_surface_get_stride (dst);
+  const int left = max_int (area->x / 2, 0);
+  const int top = max_int (area->y / 2, 0);
+  const int right = min_int ((area->x + area->width + 1) / 2, dst_width);
+  const int bottom = min_int ((area->y + area->height + 1) / 2, dst_height);
+  const guint8 *src_data = cairo_image_surface_get_data (src);
+  guint8 *dst_data = cairo_image_surface_get_data (dst);
+
+  if (left >= right || top >= bottom)
+    return;
+
+  cairo_surface_flush (src);
+  cairo_surface_flush (dst);
+
+  for (int y = top; y < bottom; y++)
+    {
+      // Odd sizes repeat the last row and column.
+      const guint8 *row0 = src_data + 2 * y * src_stride;
+      const guint8 *row1 = src_data + min_int (2 * y + 1, src_height - 1) * src_stride;
+      guint8 *out = dst_data + y * dst_stride;
+
+      for (int x = left; x < right; x++)
+        {
+          const int x0 = 8 * x;
+          const int x1 = 4 * min_int (2 * x + 1, src_width - 1);
+
+          for (int c = 0; c < 4; c++)
+            out[4 * x + c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2;
+        }
+    }
+
+  cairo_surface_mark_dirty_rectangle (dst, left, top, right - left, bottom - top);
+}
+
+static void
+mipmap_clear (struct _Mipmap *mipmap)
+{
+  for (int i = 0; i < GPAINT_MIPMAP_LEVELS; i++)
+    {
+      g_clear_pointer (&mipmap->levels[i], cairo_surface_destroy);
+      g_clear_pointer (&mipmap->damage[i], cairo_region_destroy);
+    }
+}
+
+// Returns the surface to draw the main surface from at scale, updated up to
+// the last damage, and its level. Level 0 is the main surface itself.
+cairo_surface_t *
+mipmap_get (AppState *state, double scale, int *level)
+{
+  struct _Mipmap *mipmap = &state->mipmap;
+  cairo_surface_t *src = state->main_surface;
+  int width = cairo_image_surface_get_width (src);
+  int height = cairo_image_surface_get_height (src);
+
+  *level = mipmap_level (scale);
+
+  // The reduction works on 32-bit pixels; other canvases, like the A8 ones
+  // of the gray mode, are scaled by cairo instead.
+  if (cairo_image_surface_get_format (src) != CAIRO_FORMAT_ARGB32
+      && cairo_image_surface_get_format (src) != CAIRO_FORMAT_RGB24)
+    {
+      mipmap_clear (mipmap);
+      *level = 0;
+      return src;
+    }
+
+  if (mipmap->levels[0]
+      && (cairo_image_surface_get_width (mipmap->levels[0]) != (width + 1) / 2
+          || cairo_image_surface_get_height (mipmap->levels[0]) != (height + 1) / 2))
+    mipmap_clear (mipmap);
+
+  for (int i = 0; i < *level; i++)
+    {
+      const int shift = i;
+      width = (width + 1) / 2;
+      height = (height + 1) / 2;
+
+      if (!mipmap->levels[i])
+        {
+          mipmap->levels[i] = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+          mipmap->damage[i] = cairo_region_create_rectangle (&(GdkRectangle) { 0, 0, width << (shift + 1), height << (shift + 1) });
+        }
+
+      // Damage is kept in canvas pixels. As levels are updated in order,
+      // the level below is up to date wherever this one is damaged.
+      for (int j = 0; j < cairo_region_num_rectangles (mipmap->damage[i]); j++)
+        {
+          GdkRectangle rect;
+          cairo_region_get_rectangle (mipmap->damage[i], j, &rect);
+
+          const int left = rect.x >> shift;
+          const int top = rect.y >> shift;
+          const int right = (rect.x + rect.width + (1 << shift) - 1) >> shift;
+          const int bottom = (rect.y + rect.height + (1 << shift) - 1) >> shift;
+
+          mipmap_reduce (mipmap->levels[i], src, &(GdkRectangle) { left, top, right - left, bottom - top });
+        }
+
+      cairo_region_destroy (mipmap->damage[i]);
+      mipmap->damage[i] = cairo_region_create ();
+      src = mipmap->levels[i];
+    }
+
+  return src;
+}
+
+// Marks rect of the canvas, or all of it if rect is NULL, to be filtered
+// again in every level built so far.
+void
+mipmap_invalidate (AppState *state, const GdkRectangle *rect)
+{
+  struct _Mipmap *mipmap = &state->mipmap;
+  const GdkRectangle canvas = {
+    0, 0,
+    cairo_image_surface_get_width (state->main_surface),
+    cairo_image_surface_get_height (state->main_surface),
+  };
+  GdkRectangle area;
+
+  if (!gdk_rectangle_intersect (rect ? rect : &canvas, &canvas, &area))
+    return;
+
+  for (int i = 0; i < GPAINT_MIPMAP_LEVELS && mipmap->levels[i]; i++)
+    cairo_region_union_rectangle (mipmap->damage[i], &area);
+}
+
+void
+free_mipmap (AppState *state)
+{
+  mipmap_clear (&state->mipmap);
+}
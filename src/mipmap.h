@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cairo.h>
+#include <glib.h>
+
+#include "gpaint.h"
+
+extern int mipmap_level (double scale);
+extern cairo_surface_t *mipmap_get (AppState *state, double scale, int *level);
+extern void mipmap_invalidate (AppState *state, const GdkRectangle *rect);
+extern void free_mipmap (AppState *state);
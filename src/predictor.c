@@ -0,0 +1,108 @@
+#include "predictor.h"
+
+// Extrapolates where the pointer is going from its recent positions, so the
+// stroke can be drawn ahead of the input by about the time a frame takes to
+// show. The velocity is fitted by least squares over a short window, which
+// smooths out jitter in the samples. Every function accepts a NULL Predictor
+// and does nothing then.
+
+enum
+{
+  PREDICTOR_SAMPLES = 16,
+  PREDICTOR_WINDOW = 40,    // Milliseconds of samples the velocity is fitted to
+  PREDICTOR_MAX_LEAD = 32,  // Milliseconds predicted at most
+  PREDICTOR_STALE = 50000,  // Microseconds without input after which the pointer is at rest
+};
+
+typedef struct
+{
+  double x, y;
+  guint32 time; // Of the event, in milliseconds
+} PredictorSample;
+
+struct _Predictor
+{
+  PredictorSample samples[PREDICTOR_SAMPLES]; // Ring, newest at next - 1
+  guint count;
+  guint next;
+  gint64 last_input; // Monotonic time the newest sample arrived
+};
+
+Predictor *
+predictor_new (void)
+{
+  return g_new0 (Predictor, 1);
+}
+
+void
+predictor_free (Predictor *predictor)
+{
+  g_free (predictor);
+}
+
+// Forgets the samples, at the start and the end of a stroke.
+void
+predictor_reset (Predictor *predictor)
+{
+  if (predictor)
+    predictor->count = predictor->next = 0;
+}
+
+// Adds the position (x, y) in canvas pixels the pointer had at time, in
+// milliseconds of the event clock.
+void
+predictor_add (Predictor *predictor, double x, double y, guint32 time)
+{
+  if (!predictor)
+    return;
+
+  predictor->samples[predictor->next] = (PredictorSample) { x, y, time };
+  predictor->next = (predictor->next + 1) % PREDICTOR_SAMPLES;
+  predictor->count = MIN (predictor->count + 1, PREDICTOR_SAMPLES);
+  predictor->last_input = g_get_monotonic_time ();
+}
+
+// Sets (x, y) to where the pointer is expected lead microseconds after the
+// newest sample. Returns FALSE if there is no telling: too few samples, or
+// the pointer seems to be at rest.
+gboolean
+predictor_predict (Predictor *predictor, gint64 lead, double *x, double *y)
+{
+  if (!predictor || predictor->count < 2 || g_get_monotonic_time () - predictor->last_input > PREDICTOR_STALE)
+    return FALSE;
+
+  const PredictorSample *last = &predictor->samples[(predictor->next + PREDICTOR_SAMPLES - 1) % PREDICTOR_SAMPLES];
+  double sum_t = 0.0, sum_x = 0.0, sum_y = 0.0;
+  double sum_tt = 0.0, sum_tx = 0.0, sum_ty = 0.0;
+  guint n = 0;
+
+  for (guint i = 0; i < predictor->count; i++)
+    {
+      const PredictorSample *sample = &predictor->samples[(predictor->next + PREDICTOR_SAMPLES - 1 - i) % PREDICTOR_SAMPLES];
+      const double t = -(double) (guint32) (last->time - sample->time);
+
+      if (-t > PREDICTOR_WINDOW)
+        break;
+
+      sum_t += t;
+      sum_x += sample->x;
+      sum_y += sample->y;
+      sum_tt += t * t;
+      sum_tx += t * sample->x;
+      sum_ty += t * sample->y;
+      n++;
+    }
+
+  const double variance = n * sum_tt - sum_t * sum_t;
+
+  if (n < 2 || variance <= 0.0)
+    return FALSE;
+
+  const double vx = (n * sum_tx - sum_t * sum_x) / variance;
+  const double vy = (n * sum_ty - sum_t * sum_y) / variance;
+  const double ahead = MIN (lead / 1000.0, PREDICTOR_MAX_LEAD);
+
+  *x = last->x + vx * ahead;
+  *y = last->y + vy * ahead;
+  return TRUE;
+}
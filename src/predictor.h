@@ -0,0 +1,11 @@
+#pragma once
+
+#include <glib.h>
+
+typedef struct _Predictor Predictor;
+
+extern Predictor *predictor_new (void);
+extern void predictor_free (Predictor *predictor);
+extern void predictor_reset (Predictor *predictor);
+extern void predictor_add (Predictor *predictor, double x, double y, guint32 time);
+extern gboolean predictor_predict (Predictor *predictor, gint64 lead, double *x, double *y);
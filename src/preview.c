@@ -0,0 +1,106 @@
+
+#include "preview.h"
+#include "tools/tools.h"
+#include "view.h"
+
+// The preview surface is allocated once and reused by every stroke while the
+// canvas keeps its size. A stroke leaves content only within its dirty
+// rectangle, and tools overriding the main surface also in the parts of the
+// canvas copied into the preview, so only these have to be cleared before the
+// next stroke. The main surface is copied lazily: a tool touches a rectangle
+// before it draws there.
+
+static void
+preview_clear (AppState *state)
+{
+  cairo_region_union_rectangle (state->preview_copied, &state->dirty_rect);
+
+  if (cairo_region_is_empty (state->preview_copied))
+    return;
+
+  cairo_t *cr = create_cairo (state->preview_pool, CAIRO_OPERATOR_CLEAR, CAIRO_ANTIALIAS_NONE);
+  gdk_cairo_region (cr, state->preview_copied);
+  cairo_fill (cr);
+  cairo_destroy (cr);
+
+  cairo_region_destroy (state->preview_copied);
+  state->preview_copied = cairo_region_create ();
+}
+
+// Prepares an empty preview of the canvas size for a new stroke.
+void
+preview_begin (AppState *state)
+{
+  const int width = cairo_image_surface_get_width (state->main_surface);
+  const int height = cairo_image_surface_get_height (state->main_surface);
+
+  if (state->preview_pool
+      && (cairo_image_surface_get_width (state->preview_pool) != width
+          || cairo_image_surface_get_height (state->preview_pool) != height))
+    g_clear_pointer (&state->preview_pool, cairo_surface_destroy);
+
+  if (!state->preview_pool)
+    {
+      state->preview_pool = create_surface (width, height);
+      g_clear_pointer (&state->preview_copied, cairo_region_destroy);
+      state->preview_copied = cairo_region_create ();
+    }
+  else
+    preview_clear (state);
+
+  state->dirty_rect = (GdkRectangle) { 0, 0, 0, 0 };
+  state->preview_surface = state->preview_pool;
+}
+
+// Called before a tool draws into rect, or into the whole canvas if rect is
+// NULL. Tools overriding the main surface get it copied there first.
+void
+preview_touch (AppState *state, const GdkRectangle *rect)
+{
+  if (!state->preview_surface || !state->tool->override_main_surface)
+    return;
+
+  const GdkRectangle canvas = {
+    0, 0,
+    cairo_image_surface_get_width (state->main_surface),
+    cairo_image_surface_get_height (state->main_surface),
+  };
+  GdkRectangle area;
+
+  if (!gdk_rectangle_intersect (rect ? rect : &canvas, &canvas, &area))
+    return;
+
+  cairo_region_t *missing = cairo_region_create_rectangle (&area);
+  cairo_region_subtract (missing, state->preview_copied);
+
+  if (!cairo_region_is_empty (missing))
+    {
+      cairo_t *cr = create_cairo (state->preview_surface, CAIRO_OPERATOR_SOURCE, CAIRO_ANTIALIAS_NONE);
+      cairo_set_source_surface (cr, state->main_surface, 0, 0);
+      gdk_cairo_region (cr, missing);
+      cairo_fill (cr);
+      cairo_destroy (cr);
+
+      cairo_region_union (state->preview_copied, missing);
+    }
+
+  cairo_region_destroy (missing);
+}
+
+// Finishes the stroke. The surface stays allocated for the next one.
+void
+preview_end (AppState *state)
+{
+  if (state->preview_surface)
+    view_invalidate (state, &state->dirty_rect);
+
+  state->preview_surface = NULL;
+}
+
+void
+free_preview (AppState *state)
+{
+  state->preview_surface = NULL;
+  g_clear_pointer (&state->preview_pool, cairo_surface_destroy);
+  g_clear_pointer (&state->preview_copied, cairo_region_destroy);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cairo.h>
+#include <glib.h>
+
+#include "gpaint.h"
+
+extern void preview_begin (AppState *state);
+extern void preview_touch (AppState *state, const GdkRectangle *rect);
+extern void preview_end (AppState *state);
+extern void free_preview (AppState *state);
@@ -0,0 +1,161 @@
+#include "stroke.h"
+#include "preview.h"
+#include "tools/tools.h"
+#include "view.h"
+
+// The life cycle of a stroke of the current tool, in canvas pixels. The
+// input handlers translate pointer events into these calls; they do not
+// depend on any widget, so strokes can also be driven without a window.
+
+// Part of the canvas the current stroke has touched. Returns FALSE if there
+// is none.
+gboolean
+stroke_get_rect (AppState *state, GdkRectangle *rect)
+{
+  const GdkRectangle canvas = {
+    0, 0,
+    cairo_image_surface_get_width (state->main_surface),
+    cairo_image_surface_get_height (state->main_surface),
+  };
+
+  return gdk_rectangle_intersect (&state->dirty_rect, &canvas, rect);
+}
+
+// Starts a stroke at (x, y) with the colors state->p_color and
+// state->s_color.
+void
+stroke_begin (AppState *state, gint x, gint y)
+{
+  if (state->tool->drag_begin)
+    state->tool->drag_begin (state);
+
+  state->is_drawing = TRUE;
+  state->start_point.x = x;
+  state->start_point.y = y;
+  state->last_point = state->start_point;
+
+  preview_begin (state);
+
+  // TODO
+  /* [TOOL_LINE]             	= { "Line", &global_line_tool }, */
+  /* [TOOL_RECTANGLE]        	= { "Rect", &global_rectangle_tool }, */
+  /* [TOOL_ELLIPSE]          	= { "Ellipse", &global_ellipse_tool }, */
+  /* [TOOL_SELECT_RECTANGLE] 	= { "Select rectangle",
+   * &global_select_rectangle_tool }, */
+  /* [TOOL_DRAG]             	= { "Drag", &global_drag_tool }, */
+
+  if (state->tool->type == TOOL_BRUSH
+      || state->tool->type == TOOL_BUCKET
+      || state->tool->type == TOOL_ERASER
+      || state->tool->type == TOOL_PICKER
+      || state->tool->type == TOOL_SYMMETRIC_FREEHAND
+      || state->tool->type == TOOL_FREEHAND) // TODO
+    state->tool->draw_handler (state, x, y, x, y);
+}
+
+void
+stroke_motion (AppState *state, gint x, gint y)
+{
+  if (!state->is_drawing || !state->preview_surface)
+    return;
+
+  // Let the tool draw its preview into preview_surface:
+  if (!state->tool->motion_handler)
+    {
+      // Shapes are drawn from scratch on every motion. The previous one
+      // lies within the dirty rectangle, so only that part is cleared.
+      GdkRectangle old;
+
+      if (stroke_get_rect (state, &old))
+        {
+          cairo_t *cr = create_cairo (state->preview_surface, CAIRO_OPERATOR_CLEAR, CAIRO_ANTIALIAS_NONE);
+          gdk_cairo_rectangle (cr, &old);
+          cairo_fill (cr);
+          cairo_destroy (cr);
+          view_invalidate (state, &old);
+        }
+
+      state->dirty_rect = (GdkRectangle) { 0, 0, 0, 0 };
+      state->tool->draw_handler (state, state->start_point.x, state->start_point.y, x, y);
+    }
+  else
+    state->tool->motion_handler (state, x, y);
+}
+
+// Pointer motion can arrive far more often than frames are shown. Positions
+// are queued as they come and handled together once per frame by
+// stroke_flush_motion(), so the work follows the display rate rather than the
+// input rate, without dropping any point.
+void
+stroke_queue_motion (AppState *state, gint x, gint y)
+{
+  if (!state->motion_points)
+    state->motion_points = g_array_new (FALSE, FALSE, sizeof (Point));
+
+  if (state->motion_points->len > 0)
+    {
+      const Point *last = &g_array_index (state->motion_points, Point, state->motion_points->len - 1);
+
+      if (last->x == x && last->y == y)
+        return;
+    }
+
+  g_array_append_val (state->motion_points, ((Point) { x, y }));
+}
+
+void
+stroke_flush_motion (AppState *state)
+{
+  if (!state->motion_points || state->motion_points->len == 0)
+    return;
+
+  // Shapes are redrawn from scratch on every motion, only the last one counts.
+  const guint first = state->tool->motion_handler ? 0 : state->motion_points->len - 1;
+
+  for (guint i = first; i < state->motion_points->len; i++)
+    {
+      const Point *point = &g_array_index (state->motion_points, Point, i);
+      stroke_motion (state, point->x, point->y);
+    }
+
+  g_array_set_size (state->motion_points, 0);
+}
+
+// Applies the stroke to the main surface and records it in the history.
+void
+stroke_end (AppState *state)
+{
+  GdkRectangle rect;
+
+  stroke_flush_motion (state);
+  tool_flush_lines (state);
+  tool_drop_lines (state);
+
+  if (state->preview_surface && stroke_get_rect (state, &rect))
+    {
+      // Outside of the stroke the preview is either empty or, for tools
+      // which override the main surface, an exact copy of it.
+      cairo_t *cr = create_cairo (state->main_surface, state->tool->override_main_surface ? CAIRO_OPERATOR_SOURCE : CAIRO_OPERATOR_OVER, state->antialiasing);
+      cairo_set_source_surface (cr, state->preview_surface, 0, 0);
+      gdk_cairo_rectangle (cr, &rect);
+      cairo_fill (cr);
+      cairo_destroy (cr);
+
+      save_backup_region (&state->backup_manager, state->main_surface, &rect);
+    }
+
+  preview_end (state);
+  state->is_drawing = FALSE;
+}
+
+// Drops the stroke, leaving the main surface as it was.
+void
+stroke_cancel (AppState *state)
+{
+  if (state->motion_points)
+    g_array_set_size (state->motion_points, 0);
+
+  tool_drop_lines (state);
+  preview_end (state);
+  state->is_drawing = FALSE;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <glib.h>
+
+#include "gpaint.h"
+
+extern gboolean stroke_get_rect (AppState *state, GdkRectangle *rect);
+extern void stroke_begin (AppState *state, gint x, gint y);
+extern void stroke_motion (AppState *state, gint x, gint y);
+extern void stroke_queue_motion (AppState *state, gint x, gint y);
+extern void stroke_flush_motion (AppState *state);
+extern void stroke_end (AppState *state);
+extern void stroke_cancel (AppState *state);
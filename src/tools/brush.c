@@ -1,9 +1,45 @@
 
 #include "tools-internal.h"
 
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+# define GPAINT_BRUSH_X86 1
+# include <immintrin.h>
+#else
+# define GPAINT_BRUSH_X86 0
+#endif
+
+// The brush stamps dabs: copies of a precomputed mask of its size, shape and
+// softness, tinted with its color, at regular intervals along the pointer
+// path. Dabs are blended into the preview by keeping the larger of each
+// premultiplied channel. The preview only holds this stroke in a single
+// color, so that keeps the most opaque coverage of every pixel and
+// overlapping dabs do not build up.
+
+enum
+{
+  BRUSH_MASK_CACHE_SIZE = 8, // Masks kept, least recently used dropped first
+};
+
+static const double brush_spacing = 0.1; // Between dabs, relative to the size
+
+typedef struct
+{
+  BrushShape shape;
+  gint size;     // In quarter pixels
+  gint softness; // In hundredths
+  gboolean aliased;
+  gint radius;   // The mask is 2 * radius + 1 pixels wide, centered on a pixel
+  guint8 *alpha;
+  guint32 color;   // Color stamp is tinted with
+  guint32 *stamp;  // Premultiplied ARGB32 dab, NULL until first used
+  guint64 used;
+} BrushMask;
+
+static BrushMask brush_masks[BRUSH_MASK_CACHE_SIZE];
+static guint64 brush_masks_clock;
+
 static const struct raw_bitmap brush_data;
 static void draw_brush_handler (AppState *state, gint x0, gint y0, gint x1, gint y1);
-static void draw_brush_cursor (AppState *state, gint x0, gint y0);
 static void motion_brush_handler (AppState *state, gint x, gint y);
 
 const Tool global_brush_tool = {
@@ -18,40 +54,294 @@ const Tool global_brush_tool = {
 };
 
 static void
-draw_brush_handler (AppState *state, gint x0, gint y0, gint x1, gint y1)
+brush_mask_fill (BrushMask *mask)
+{
+  const double r = mask->size / 8.0;
+  const double inner = r * (1.0 - mask->softness / 100.0);
+  const int n = 2 * mask->radius + 1;
+
+  mask->alpha = g_malloc ((gsize) n * n);
+
+  for (int j = 0; j < n; j++)
+    for (int i = 0; i < n; i++)
+      {
+        const double dx = fabs ((double) (i - mask->radius));
+        const double dy = fabs ((double) (j - mask->radius));
+        const double d = mask->shape == BRUSH_SHAPE_SQUARE ? fmax (dx, dy) : hypot (dx, dy);
+        double coverage;
+
+        if (mask->aliased)
+          coverage = d <= r ? 1.0 : 0.0;
+        else
+          coverage = CLAMP (r + 0.5 - d, 0.0, 1.0);
+
+        if (d > inner && r > inner)
+          {
+            const double t = CLAMP ((r - d) / (r - inner), 0.0, 1.0);
+            coverage *= t * t * (3.0 - 2.0 * t);
+          }
+
+        if (mask->aliased)
+          coverage = coverage >= 0.5 ? 1.0 : 0.0;
+
+        mask->alpha[j * n + i] = (guint8) round (coverage * 255.0);
+      }
+}
+
+static void
+brush_mask_clear (BrushMask *mask)
 {
-  // TODO
-  /* For brush, simply plot the pixel at the new coordinate */
-  // handle_pixel (state, x1, y1, state->color);
-
-  cairo_t *cr = create_cairo (state->preview_surface, CAIRO_OPERATOR_SOURCE, state->antialiasing);
-  gdk_cairo_set_source_rgba (cr, state->p_color);
-  gdouble size = state->brush_size;
-  cairo_rectangle (cr, x0 + 0.5 - size / 2, y0 + 0.5 - size / 2, size, size);
-  cairo_fill (cr);
-  cairo_destroy (cr);
+  g_free (mask->alpha);
+  g_free (mask->stamp);
+  *mask = (BrushMask) { 0 };
 }
 
-/* static void */
-/* draw_brush_cursor (AppState *state, gint x0, gint y0) */
-/* { */
-/*   cairo_t *cr = create_cairo (state->cursor_surface, CAIRO_OPERATOR_SOURCE);
- */
-/*   gdk_cairo_set_source_rgba (cr, state->color); */
-/*   gdouble size = state->brush_size; */
-/*   cairo_rectangle (cr, x0 + 0.5 - size / 2, y0 + 0.5 - size / 2, size,
- * size);
- */
-/*   cairo_fill (cr); */
-/*   cairo_destroy (cr); */
-/* } */
+// The mask for the current brush, tinted with color.
+static const BrushMask *
+get_brush_mask (AppState *state, const GdkRGBA *color)
+{
+  const BrushMask key = {
+    .shape = state->brush_shape,
+    .size = (gint) round (MAX (state->brush_size, 1.0) * 4.0),
+    .softness = (gint) round (CLAMP (state->brush_softness, 0.0, 1.0) * 100.0),
+    .aliased = state->antialiasing == CAIRO_ANTIALIAS_NONE,
+  };
+  BrushMask *mask = NULL;
+
+  for (int i = 0; i < BRUSH_MASK_CACHE_SIZE && !mask; i++)
+    if (brush_masks[i].alpha
+        && brush_masks[i].shape == key.shape && brush_masks[i].size == key.size
+        && brush_masks[i].softness == key.softness && brush_masks[i].aliased == key.aliased)
+      mask = &brush_masks[i];
+
+  if (!mask)
+    {
+      mask = &brush_masks[0];
+
+      for (int i = 1; i < BRUSH_MASK_CACHE_SIZE; i++)
+        if (brush_masks[i].used < mask->used)
+          mask = &brush_masks[i];
+
+      brush_mask_clear (mask);
+      *mask = key;
+      mask->radius = (gint) ceil (key.size / 8.0);
+      brush_mask_fill (mask);
+    }
+
+  mask->used = ++brush_masks_clock;
+
+  const guint32 clr = gdk_rgba_to_premultiplied_clr (color);
+
+  if (!mask->stamp || mask->color != clr)
+    {
+      const gsize count = (gsize) (2 * mask->radius + 1) * (2 * mask->radius + 1);
+
+      if (!mask->stamp)
+        mask->stamp = g_new (guint32, count);
+
+      for (gsize i = 0; i < count; i++)
+        {
+          const guint m = mask->alpha[i];
+          guint32 pixel = 0;
+
+          for (int shift = 0; shift < 32; shift += 8)
+            pixel |= (((clr >> shift & 0xff) * m + 127) / 255) << shift;
+
+          mask->stamp[i] = pixel;
+        }
+
+      mask->color = clr;
+    }
+
+  return mask;
+}
+
+void
+free_brush_masks (void)
+{
+  for (int i = 0; i < BRUSH_MASK_CACHE_SIZE; i++)
+    brush_mask_clear (&brush_masks[i]);
+}
+
+// Keeps the larger of every channel of dst and src.
+typedef void (*BlendRowFunc) (guint32 *dst, const guint32 *src, gint width);
 
+static void
+blend_row_scalar (guint32 *dst, const guint32 *src, gint width)
+{
+  for (gint x = 0; x < width; x++)
+    {
+      guint32 pixel = 0;
+
+      for (int shift = 0; shift < 32; shift += 8)
+        pixel |= MAX (dst[x] & (0xffu << shift), src[x] & (0xffu << shift));
+
+      dst[x] = pixel;
+    }
+}
+
+#if GPAINT_BRUSH_X86
+__attribute__ ((target ("sse2"))) static void
+blend_row_sse2 (guint32 *dst, const guint32 *src, gint width)
+{
+  gint x = 0;
+
+  for (; x + 4 <= width; x += 4)
+    {
+      const __m128i d = _mm_loadu_si128 ((const __m128i *) (dst + x));
+      const __m128i s = _mm_loadu_si128 ((const __m128i *) (src + x));
+      _mm_storeu_si128 ((__m128i *) (dst + x), _mm_max_epu8 (d, s));
+    }
+
+  blend_row_scalar (dst + x, src + x, width - x);
+}
+
+__attribute__ ((target ("avx2"))) static void
+blend_row_avx2 (guint32 *dst, const guint32 *src, gint width)
+{
+  gint x = 0;
+
+  for (; x + 8 <= width; x += 8)
+    {
+      const __m256i d = _mm256_loadu_si256 ((const __m256i *) (dst + x));
+      const __m256i s = _mm256_loadu_si256 ((const __m256i *) (src + x));
+      _mm256_storeu_si256 ((__m256i *) (dst + x), _mm256_max_epu8 (d, s));
+    }
+
+  blend_row_sse2 (dst + x, src + x, width - x);
+}
+#endif
+
+static BlendRowFunc
+get_blend_row (void)
+{
+  static BlendRowFunc func = NULL;
+
+  if (func)
+    return func;
+
+  func = blend_row_scalar;
+
+#if GPAINT_BRUSH_X86
+  __builtin_cpu_init ();
+
+  if (__builtin_cpu_supports ("avx2"))
+    func = blend_row_avx2;
+  else if (__builtin_cpu_supports ("sse2"))
+    func = blend_row_sse2;
+#endif
+
+  return func;
+}
+
+// Stamps a dab centered on pixel (x, y). The caller marks the area dirty
+// and brackets the stamping with a flush and mark_dirty of the surface.
+static void
+stamp_dab (cairo_surface_t *surface, const BrushMask *mask, gint x, gint y)
+{
+  const BlendRowFunc blend_row = get_blend_row ();
+  const int n = 2 * mask->radius + 1;
+  const GdkRectangle canvas = {
+    0, 0,
+    cairo_image_surface_get_width (surface),
+    cairo_image_surface_get_height (surface),
+  };
+  const GdkRectangle dab = { x - mask->radius, y - mask->radius, n, n };
+  GdkRectangle area;
+
+  if (!gdk_rectangle_intersect (&dab, &canvas, &area))
+    return;
+
+  guchar *data = cairo_image_surface_get_data (surface);
+  const int stride = cairo_image_surface_get_stride (surface);
+
+  for (int row = area.y; row < area.y + area.height; row++)
+    blend_row ((guint32 *) (data + (gsize) row * stride) + area.x,
+               mask->stamp + (gsize) (row - dab.y) * n + (area.x - dab.x),
+               area.width);
+}
+
+static void
+draw_brush_handler (AppState *state, gint x0, gint y0, gint x1, gint y1)
+{
+  const BrushMask *mask = get_brush_mask (state, state->p_color);
+  const int n = 2 * mask->radius + 1;
+
+  tool_mark_dirty (state, &(GdkRectangle) { x0 - mask->radius, y0 - mask->radius, n, n });
+  cairo_surface_flush (state->preview_surface);
+  stamp_dab (state->preview_surface, mask, x0, y0);
+  cairo_surface_mark_dirty (state->preview_surface);
+  state->brush_distance = 0.0;
+}
+
+// Stamps dabs every brush_spacing along the segment from the last point,
+// carrying the distance since the last dab over to the next segment.
 static void
 motion_brush_handler (AppState *state, gint x, gint y)
 {
-  draw_line_with_width_and_color (state->preview_surface, state->last_point.x, state->last_point.y, x, y, state->brush_size, state->p_color, state->antialiasing);
+  const BrushMask *mask = get_brush_mask (state, state->p_color);
+  const gint x0 = state->last_point.x;
+  const gint y0 = state->last_point.y;
+  const double length = hypot (x - x0, y - y0);
+  const double spacing = MAX (1.0, state->brush_size * brush_spacing);
+  double d = spacing - state->brush_distance;
+
   state->last_point.x = x;
   state->last_point.y = y;
+
+  if (d > length)
+    {
+      state->brush_distance += length;
+      return;
+    }
+
+  const int left = min_int (x0, x) - mask->radius;
+  const int top = min_int (y0, y) - mask->radius;
+
+  tool_mark_dirty (state, &(GdkRectangle) { left, top, max_int (x0, x) + mask->radius + 1 - left, max_int (y0, y) + mask->radius + 1 - top });
+  cairo_surface_flush (state->preview_surface);
+
+  for (; d <= length; d += spacing)
+    stamp_dab (state->preview_surface, mask, (gint) round (x0 + (x - x0) * d / length), (gint) round (y0 + (y - y0) * d / length));
+
+  cairo_surface_mark_dirty (state->preview_surface);
+  state->brush_distance = length - (d - spacing);
+}
+
+// Draws to cr, in canvas pixels, the dabs which a motion to (x, y) would
+// stamp, without stamping them. Used to show the predicted part of a stroke.
+void
+brush_draw_tail (AppState *state, cairo_t *cr, gint x, gint y)
+{
+  const BrushMask *mask = get_brush_mask (state, state->p_color);
+  const gint x0 = state->last_point.x;
+  const gint y0 = state->last_point.y;
+  const double length = hypot (x - x0, y - y0);
+  const double spacing = MAX (1.0, state->brush_size * brush_spacing);
+  double d = spacing - state->brush_distance;
+
+  if (d > length)
+    return;
+
+  const int left = min_int (x0, x) - mask->radius;
+  const int top = min_int (y0, y) - mask->radius;
+  cairo_surface_t *tail = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                                      max_int (x0, x) + mask->radius + 1 - left,
+                                                      max_int (y0, y) + mask->radius + 1 - top);
+
+  cairo_surface_flush (tail);
+
+  for (; d <= length; d += spacing)
+    stamp_dab (tail, mask, (gint) round (x0 + (x - x0) * d / length) - left, (gint) round (y0 + (y - y0) * d / length) - top);
+
+  cairo_surface_mark_dirty (tail);
+
+  cairo_save (cr);
+  cairo_set_source_surface (cr, tail, left, top);
+  cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_NEAREST);
+  cairo_paint (cr);
+  cairo_restore (cr);
+  cairo_surface_destroy (tail);
 }
 
 // clang-format off
@@ -1,6 +1,21 @@
 
 #include "tools-internal.h"
 
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+# define GPAINT_FILL_X86 1
+# include <immintrin.h>
+#else
+# define GPAINT_FILL_X86 0
+#endif
+
+// Fills of canvases at least this large are split into horizontal bands
+// filled by a thread each.
+enum
+{
+  FILL_PARALLEL_MIN_PIXELS = 4096 * 1024,
+  FILL_MIN_BAND_ROWS = 64,
+};
+
 static const struct raw_bitmap bucket_data;
 static void draw_bucket_handler (AppState *state, gint x0, gint y0, gint x1, gint y1);
 
@@ -21,116 +36,495 @@ const Tool global_bucket_tool = {
   .is_drawing = TRUE,
 };
 
-static void
-draw_bucket_handler (AppState *state, gint x0, gint y0, gint x1, gint y1)
-{ // TODO... Ensure it is the most optimal solution
-  gint width = cairo_image_surface_get_width (state->preview_surface);
-  gint height = cairo_image_surface_get_height (state->preview_surface);
+// A horizontal run of pixels on row y, already filled, whose neighbours on
+// row y + dy still have to be scanned.
+typedef struct
+{
+  gint left, right;
+  gint y, dy;
+} FillSpan;
 
-  if (x1 < 0 || x1 >= width || y1 < 0 || y1 >= height)
-    return;
+typedef struct
+{
+  guint32 *data;
+  gint stride; // In pixels
+  gint width, height;
+  guint32 target;
+  guint32 color;
+  guint tolerance; // At most 255
+  guint8 *visited; // One bit per pixel, only used with a tolerance
+  gsize visited_stride; // Bytes per row of visited, rows never share a byte
+  gint top, bottom; // Rows this context fills
+  GArray *stack;
+  GArray *outgoing; // Spans for rows outside [top, bottom)
+  GdkRectangle bounds;
+} FillContext;
+
+// Whether every channel of the pixel is within tolerance of the target.
+static inline gboolean
+pixel_matches (guint32 pixel, guint32 target, guint tolerance)
+{
+  for (guint shift = 0; shift < 32; shift += 8)
+    {
+      const gint a = (gint) ((pixel >> shift) & 0xFF);
+      const gint b = (gint) ((target >> shift) & 0xFF);
 
-  // TODO
-  /* copy_surface (state->preview_surface, state->main_surface); */
+      if ((guint) abs (a - b) > tolerance)
+        return FALSE;
+    }
 
-  /* const guchar *main_data = cairo_image_surface_get_data
-   * (state->main_surface); */
-  guchar *preview_data = cairo_image_surface_get_data (state->preview_surface);
-  gint stride = cairo_image_surface_get_stride (state->preview_surface);
+  return TRUE;
+}
+
+static inline guint32 *
+fill_row (const FillContext *ctx, gint y)
+{
+  return ctx->data + (gsize) y * ctx->stride;
+}
+
+// With a tolerance the fill color may match the target itself, so filled
+// pixels are remembered instead of being recognized by their color.
+static inline gboolean
+fill_matches (const FillContext *ctx, const guint32 *row, gint x, gint y)
+{
+  if (!ctx->visited)
+    return row[x] == ctx->target;
 
-  const guint32 target_color = get_pix_clr (preview_data, x1, y1, stride, gpaint_cairo_get_bytes_per_pixel (state->preview_surface));
+  if (ctx->visited[(gsize) y * ctx->visited_stride + x / 8] & (1u << (x % 8)))
+    return FALSE;
 
-  guint32 color = gdk_rgba_to_clr (state->p_color);
+  return pixel_matches (row[x], ctx->target, ctx->tolerance);
+}
 
-  // TODO: if do not check it goes to infinite cycle
-  if (target_color == color)
+static inline void
+fill_push (FillContext *ctx, gint left, gint right, gint y, gint dy)
+{
+  if (y + dy < 0 || y + dy >= ctx->height)
     return;
 
-  size_t capacity = 256, head = 0, tail = 0;
-  Point *buffer = g_new (Point, capacity);
+  const FillSpan span = { left, right, y, dy };
+
+  if (y + dy < ctx->top || y + dy >= ctx->bottom)
+    g_array_append_val (ctx->outgoing, span);
+  else
+    g_array_append_val (ctx->stack, span);
+}
+
+static inline void
+fill_run (FillContext *ctx, guint32 *row, gint left, gint right, gint y)
+{
+  for (gint x = left; x <= right; x++)
+    row[x] = ctx->color;
+
+  if (ctx->visited)
+    for (gint x = left; x <= right; x++)
+      ctx->visited[(gsize) y * ctx->visited_stride + x / 8] |= 1u << (x % 8);
+
+  const GdkRectangle run = { left, y, right - left + 1, 1 };
+  gpaint_rectangle_union (&ctx->bounds, &run);
+}
+
+// Span fill after Heckbert's "A Seed Fill Algorithm" (Graphics Gems I).
+// Whole runs are filled at once and only runs are kept on the stack, so the
+// stack stays proportional to the number of open span edges rather than to
+// the filled area. Without a tolerance the target color must differ from the
+// fill color.
+static void
+fill_seed (FillContext *ctx, gint x, gint y)
+{
+  fill_push (ctx, x, x, y, 1);
+  fill_push (ctx, x, x, y + 1, -1);
+}
+
+// Processes the spans on the stack until none is left. Spans reaching rows
+// outside of the context are moved to the outgoing list.
+static void
+scanline_fill (FillContext *ctx)
+{
+  while (ctx->stack->len > 0)
+    {
+      const FillSpan span = g_array_index (ctx->stack, FillSpan, ctx->stack->len - 1);
+      g_array_set_size (ctx->stack, ctx->stack->len - 1);
+
+      const gint y = span.y + span.dy;
+      guint32 *row = fill_row (ctx, y);
+      gint x, left;
+
+      // Extend to the left of the parent span.
+      for (x = span.left; x >= 0 && fill_matches (ctx, row, x, y); x--)
+        ;
+
+      if (x < span.left)
+        {
+          left = x + 1;
+
+          // Leak back around the left end of the parent span.
+          if (left < span.left)
+            fill_push (ctx, left, span.left - 1, y, -span.dy);
 
-  /* GQueue *queue = g_queue_new (); */
-  /* Point *start = g_new (Point, 1); */
-  /* *start = (Point) { x1, y1 }; */
-  /* g_queue_push_tail (queue, start); */
+          x = span.left + 1;
+        }
+      else
+        {
+          for (x = span.left + 1; x <= span.right && !fill_matches (ctx, row, x, y); x++)
+            ;
+
+          left = x;
+
+          if (x > span.right)
+            continue;
+        }
+
+      do
+        {
+          while (x < ctx->width && fill_matches (ctx, row, x, y))
+            x++;
+
+          fill_run (ctx, row, left, x - 1, y);
+          fill_push (ctx, left, x - 1, y, span.dy);
+
+          // Leak back around the right end of the parent span.
+          if (x > span.right + 1)
+            fill_push (ctx, span.right + 1, x - 1, y, -span.dy);
+
+          // Skip to the next run within the parent span.
+          for (x++; x <= span.right && !fill_matches (ctx, row, x, y); x++)
+            ;
+
+          left = x;
+        }
+      while (x <= span.right);
+    }
+}
+
+// The parallel fill splits the canvas into horizontal bands and fills them in
+// rounds. In every round each band with pending spans is filled on its own
+// thread as far as it can get; spans which cross into a neighbouring band
+// are handed over between the rounds. The filled region is the connected
+// component of the seed either way, so the result is identical to the
+// serial fill. The threads are started with the first large fill and kept
+// for the following ones.
+typedef struct
+{
+  GMutex lock;
+  GCond done;
+  guint pending;
+} FillRound;
+
+// A band to fill in the current round.
+typedef struct
+{
+  FillContext *band;
+  FillRound *round;
+} FillJob;
+
+static GThreadPool *fill_pool;
+
+static void
+fill_band (gpointer data, gpointer user_data)
+{
+  const FillJob *job = data;
+  FillRound *round = job->round;
 
-  buffer[tail++] = (Point) { x1, y1 };
+  scanline_fill (job->band);
 
-  while (head != tail)
+  g_mutex_lock (&round->lock);
+
+  if (--round->pending == 0)
+    g_cond_signal (&round->done);
+
+  g_mutex_unlock (&round->lock);
+}
+
+static void
+parallel_fill (FillContext *ctx, gint x, gint y, guint count)
+{
+  const gint rows = (ctx->height + (gint) count - 1) / (gint) count;
+  FillContext *bands = g_new (FillContext, count);
+  FillJob *jobs = g_new (FillJob, count);
+  FillRound round = { .pending = 0 };
+
+  g_mutex_init (&round.lock);
+  g_cond_init (&round.done);
+
+  if (!fill_pool)
+    fill_pool = g_thread_pool_new (fill_band, NULL, (gint) g_get_num_processors (), TRUE, NULL);
+
+  for (guint i = 0; i < count; i++)
+    {
+      jobs[i] = (FillJob) { &bands[i], &round };
+      bands[i] = *ctx;
+      bands[i].top = (gint) i * rows;
+      bands[i].bottom = MIN (ctx->height, bands[i].top + rows);
+      bands[i].stack = g_array_new (FALSE, FALSE, sizeof (FillSpan));
+      bands[i].outgoing = g_array_new (FALSE, FALSE, sizeof (FillSpan));
+      bands[i].bounds = (GdkRectangle) { 0, 0, 0, 0 };
+    }
+
+  fill_seed (&bands[y / rows], x, y);
+
+  for (;;)
     {
-      /* Point *current = (Point *) g_queue_pop_head (queue); */
-      Point p = buffer[head++];
-      if (head == capacity)
-        head = 0;
+      // Hand over the spans which left their band.
+      for (guint i = 0; i < count; i++)
+        {
+          for (guint j = 0; j < bands[i].outgoing->len; j++)
+            {
+              const FillSpan *span = &g_array_index (bands[i].outgoing, FillSpan, j);
+              g_array_append_val (bands[(span->y + span->dy) / rows].stack, *span);
+            }
 
-      gint x = p.x;
-      gint y = p.y;
+          g_array_set_size (bands[i].outgoing, 0);
+        }
+
+      g_mutex_lock (&round.lock);
+
+      for (guint i = 0; i < count; i++)
+        if (bands[i].stack->len > 0)
+          {
+            round.pending++;
+            g_thread_pool_push (fill_pool, &jobs[i], NULL);
+          }
+
+      if (round.pending == 0)
+        {
+          g_mutex_unlock (&round.lock);
+          break;
+        }
 
-      if (x < 0 || x >= width || y < 0 || y >= height)
+      while (round.pending > 0)
+        g_cond_wait (&round.done, &round.lock);
+
+      g_mutex_unlock (&round.lock);
+    }
+
+  g_mutex_clear (&round.lock);
+  g_cond_clear (&round.done);
+
+  for (guint i = 0; i < count; i++)
+    {
+      gpaint_rectangle_union (&ctx->bounds, &bands[i].bounds);
+      g_array_free (bands[i].stack, TRUE);
+      g_array_free (bands[i].outgoing, TRUE);
+    }
+
+  g_free (jobs);
+  g_free (bands);
+}
+
+// Stops the threads of the parallel fill.
+void
+free_fill_pool (void)
+{
+  if (fill_pool)
+    g_thread_pool_free (g_steal_pointer (&fill_pool), FALSE, TRUE);
+}
+
+// Replaces the pixels of a row which match the target, and reports the first
+// and the last replaced one. first must be negative initially.
+typedef void (*ReplaceRowFunc) (guint32 *row, gint width, guint32 target, guint32 color, guint tolerance, gint *first, gint *last);
+
+static void
+replace_row_scalar (guint32 *row, gint width, guint32 target, guint32 color, guint tolerance, gint *first, gint *last)
+{
+  for (gint x = 0; x < width; x++)
+    {
+      if (!pixel_matches (row[x], target, tolerance))
+        continue;
+
+      row[x] = color;
+
+      if (*first < 0)
+        *first = x;
+
+      *last = x;
+    }
+}
+
+#if GPAINT_FILL_X86
+// Per-channel distance through saturating subtraction: a channel is within
+// tolerance if |p - t| - tolerance saturates to zero, and a pixel matches if
+// all of its four channels do.
+__attribute__ ((target ("sse2"))) static void
+replace_row_sse2 (guint32 *row, gint width, guint32 target, guint32 color, guint tolerance, gint *first, gint *last)
+{
+  const __m128i t = _mm_set1_epi32 ((int) target);
+  const __m128i c = _mm_set1_epi32 ((int) color);
+  const __m128i tol = _mm_set1_epi8 ((char) tolerance);
+  const __m128i zero = _mm_setzero_si128 ();
+  gint x = 0;
+
+  for (; x + 4 <= width; x += 4)
+    {
+      const __m128i p = _mm_loadu_si128 ((const __m128i *) (row + x));
+      const __m128i diff = _mm_or_si128 (_mm_subs_epu8 (p, t), _mm_subs_epu8 (t, p));
+      const __m128i mask = _mm_cmpeq_epi32 (_mm_subs_epu8 (diff, tol), zero);
+      const int bits = _mm_movemask_ps (_mm_castsi128_ps (mask));
+
+      if (!bits)
         continue;
 
-      guint32 current_color = get_pix_clr (preview_data, x, y, stride, gpaint_cairo_get_bytes_per_pixel (state->preview_surface));
+      _mm_storeu_si128 ((__m128i *) (row + x), _mm_or_si128 (_mm_and_si128 (mask, c), _mm_andnot_si128 (mask, p)));
+
+      if (*first < 0)
+        *first = x + __builtin_ctz ((unsigned) bits);
+
+      *last = x + 31 - __builtin_clz ((unsigned) bits);
+    }
+
+  gint tail_first = -1, tail_last = 0;
+  replace_row_scalar (row + x, width - x, target, color, tolerance, &tail_first, &tail_last);
+
+  if (tail_first >= 0)
+    {
+      if (*first < 0)
+        *first = x + tail_first;
+
+      *last = x + tail_last;
+    }
+}
+
+__attribute__ ((target ("avx2"))) static void
+replace_row_avx2 (guint32 *row, gint width, guint32 target, guint32 color, guint tolerance, gint *first, gint *last)
+{
+  const __m256i t = _mm256_set1_epi32 ((int) target);
+  const __m256i c = _mm256_set1_epi32 ((int) color);
+  const __m256i tol = _mm256_set1_epi8 ((char) tolerance);
+  const __m256i zero = _mm256_setzero_si256 ();
+  gint x = 0;
 
-      if (current_color != target_color)
+  for (; x + 8 <= width; x += 8)
+    {
+      const __m256i p = _mm256_loadu_si256 ((const __m256i *) (row + x));
+      const __m256i diff = _mm256_or_si256 (_mm256_subs_epu8 (p, t), _mm256_subs_epu8 (t, p));
+      const __m256i mask = _mm256_cmpeq_epi32 (_mm256_subs_epu8 (diff, tol), zero);
+      const int bits = _mm256_movemask_ps (_mm256_castsi256_ps (mask));
+
+      if (!bits)
         continue;
 
-      set_pix_clr (preview_data, x, y, stride, gpaint_cairo_get_bytes_per_pixel (state->preview_surface), color);
+      _mm256_storeu_si256 ((__m256i *) (row + x), _mm256_blendv_epi8 (p, c, mask));
+
+      if (*first < 0)
+        *first = x + __builtin_ctz ((unsigned) bits);
+
+      *last = x + 31 - __builtin_clz ((unsigned) bits);
+    }
+
+  gint tail_first = -1, tail_last = 0;
+  replace_row_sse2 (row + x, width - x, target, color, tolerance, &tail_first, &tail_last);
 
-      const Point neighbors[] =
+  if (tail_first >= 0)
+    {
+      if (*first < 0)
+        *first = x + tail_first;
+
+      *last = x + tail_last;
+    }
+}
+#endif
+
+static ReplaceRowFunc
+get_replace_row (void)
+{
+  static ReplaceRowFunc func = NULL;
+
+  if (func)
+    return func;
+
+  func = replace_row_scalar;
+
+#if GPAINT_FILL_X86
+  __builtin_cpu_init ();
+
+  if (__builtin_cpu_supports ("avx2"))
+    func = replace_row_avx2;
+  else if (__builtin_cpu_supports ("sse2"))
+    func = replace_row_sse2;
+#endif
+
+  return func;
+}
+
+// Replaces every matching pixel of the canvas, connected or not.
+static void
+global_fill (FillContext *ctx)
+{
+  const ReplaceRowFunc replace_row = get_replace_row ();
+
+  for (gint y = 0; y < ctx->height; y++)
+    {
+      gint first = -1, last = 0;
+      replace_row (fill_row (ctx, y), ctx->width, ctx->target, ctx->color, ctx->tolerance, &first, &last);
+
+      if (first >= 0)
         {
-          { x - 1, y     },
-          { x + 1, y     },
-          { x,     y - 1 },
-          { x,     y + 1 }
-        };
+          const GdkRectangle run = { first, y, last - first + 1, 1 };
+          gpaint_rectangle_union (&ctx->bounds, &run);
+        }
+    }
+}
 
-      for (size_t i = 0; i < G_N_ELEMENTS (neighbors); i++)
+static void
+draw_bucket_handler (AppState *state, gint x0, gint y0, gint x1, gint y1)
+{
+  gint width = cairo_image_surface_get_width (state->preview_surface);
+  gint height = cairo_image_surface_get_height (state->preview_surface);
+
+  if (x1 < 0 || x1 >= width || y1 < 0 || y1 >= height)
+    return;
+
+  // The fill may spread over the whole canvas.
+  preview_touch (state, NULL);
+  cairo_surface_flush (state->preview_surface);
+
+  FillContext ctx = {
+    .data = (guint32 *) cairo_image_surface_get_data (state->preview_surface),
+    .stride = cairo_image_surface_get_stride (state->preview_surface) / (gint) sizeof (guint32),
+    .width = width,
+    .height = height,
+    .color = gdk_rgba_to_clr (state->p_color),
+    // Channels differ by at most 255, and the vector code holds the
+    // tolerance in a byte.
+    .tolerance = MIN (state->fill_tolerance, 255),
+    .top = 0,
+    .bottom = height,
+  };
+
+  ctx.target = fill_row (&ctx, y1)[x1];
+
+  // Nothing would change, and the exact fill relies on filled pixels no
+  // longer matching the target.
+  if (ctx.target == ctx.color && ctx.tolerance == 0)
+    return;
+
+  if (state->fill_global)
+    global_fill (&ctx);
+  else
+    {
+      const guint threads = MIN (g_get_num_processors (), (guint) (height / FILL_MIN_BAND_ROWS));
+
+      if (ctx.tolerance > 0)
         {
-          gint nx = neighbors[i].x;
-          gint ny = neighbors[i].y;
+          ctx.visited_stride = ((gsize) width + 7) / 8;
+          ctx.visited = g_malloc0 (ctx.visited_stride * height);
+        }
 
-          if (nx >= 0 && nx < width && ny >= 0 && ny < height)
-            {
-              const guint32 neighbor_color = get_pix_clr (preview_data, nx, ny, stride, gpaint_cairo_get_bytes_per_pixel (state->preview_surface));
-
-              if (neighbor_color != target_color)
-                continue;
-
-              // Before enqueue, check if buffer is full
-              size_t next_tail = (tail + 1) % capacity;
-
-              if (next_tail == head)
-                {
-                  // Buffer full
-                  size_t new_cap = capacity * 2;
-                  Point *new_buf = g_renew (Point, buffer, new_cap);
-
-                  // TODO: required?
-                  // If head > tail, move wrapped-around segment
-                  if (head > tail)
-                    {
-                      // TODO
-                      /* // Move [0..tail) to [capacity..capacity+tail) */
-                      /* memcpy (new_buf + capacity, new_buf, tail * sizeof (*buffer)); */
-                      /* tail = capacity + tail; */
-                      tail = capacity + 1;
-                    }
-
-                  buffer = new_buf;
-                  capacity = new_cap;
-                  next_tail = (tail + 1) % capacity;
-                }
-
-              // Enqueue at tail
-              buffer[tail] = (Point) { nx, ny };
-              tail = next_tail;
-            }
+      if ((gsize) width * height >= FILL_PARALLEL_MIN_PIXELS && threads > 1)
+        parallel_fill (&ctx, x1, y1, threads);
+      else
+        {
+          ctx.stack = g_array_sized_new (FALSE, FALSE, sizeof (FillSpan), 256);
+          fill_seed (&ctx, x1, y1);
+          scanline_fill (&ctx);
+          g_array_free (ctx.stack, TRUE);
         }
+
+      g_free (ctx.visited);
     }
 
-  g_free (buffer);
+  tool_mark_dirty (state, &ctx.bounds);
   cairo_surface_mark_dirty (state->preview_surface);
-  gtk_widget_queue_draw (state->drawing_area);
 }
 
 // clang-format off
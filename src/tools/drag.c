@@ -1,6 +1,7 @@
 
 
 #include "tools-internal.h"
+#include "view.h"
 
 static const struct raw_bitmap grab_data;
 static void draw_drag_handler (AppState *state, gint x0, gint y0, gint x1, gint y1);
@@ -49,7 +50,10 @@ update_adjustments (AppState *state, double dx, double dy)
 
   gtk_adjustment_set_value (state->hadj, new_x);
   gtk_adjustment_set_value (state->vadj, new_y);
-  gtk_widget_queue_draw (state->drawing_area); // TODO
+
+  // The canvas itself is unchanged: the view moves what stays visible and
+  // composites only the uncovered part, so no pixels are damaged here.
+  view_invalidate (state, &(const GdkRectangle) { 0, 0, 0, 0 });
 }
 
 /* Inertial scrolling callback:
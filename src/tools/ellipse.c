@@ -40,6 +40,9 @@ draw_ellipse (AppState *state, gint x0, gint y0, gint x1, gint y1)
   cairo_set_line_join (cr, CAIRO_LINE_JOIN_ROUND);
   gdk_cairo_set_source_rgba (cr, state->p_color);
 
+  // The inner fill stays within the outline.
+  tool_mark_path_dirty (state, cr, TRUE);
+
   if (state->fill_type == FILL_TRANSPARENT || state->fill_type == FILL_SECONDARY)
     cairo_stroke (cr);
   else
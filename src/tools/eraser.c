@@ -19,26 +19,36 @@ const Tool global_eraser_tool =
   };
 
 static void
-draw_eraser (cairo_surface_t *surface, const GdkRGBA *color, gint x, gint y, gdouble size, cairo_antialias_t antialiasing)
+draw_eraser (AppState *state, cairo_surface_t *surface, const GdkRGBA *color, gint x, gint y, gdouble size, cairo_antialias_t antialiasing)
 {
   cairo_t *cr = create_cairo (surface, CAIRO_OPERATOR_SOURCE, antialiasing);
   gdk_cairo_set_source_rgba (cr, color);
   cairo_rectangle (cr, x + 0.5 - size / 2, y + 0.5 - size / 2, size, size);
+  tool_mark_path_dirty (state, cr, FALSE);
   cairo_fill (cr);
   cairo_destroy (cr);
 }
 
+// The color the eraser leaves behind.
+const GdkRGBA *
+eraser_get_color (AppState *state)
+{
+  return &state->secondary_color;
+}
+
 static void
 draw_eraser_handler (AppState *state, gint x0, gint y0, gint x1, gint y1)
 {
-  draw_eraser (state->preview_surface, &state->secondary_color, x0, y0, state->eraser_size, state->antialiasing);
+  draw_eraser (state, state->preview_surface, eraser_get_color (state), x0, y0, state->eraser_size, state->antialiasing);
 }
 
 static void
 motion_eraser_handler (AppState *state, gint x, gint y)
 {
-  draw_line_with_width_and_color (state->preview_surface, state->last_point.x, state->last_point.y, x, y, state->eraser_size, &state->secondary_color, state->antialiasing);
-  draw_eraser (state->preview_surface, &state->secondary_color, x, y, state->eraser_size, state->antialiasing);
+  const GdkRGBA *color = eraser_get_color (state);
+
+  draw_line_with_width_and_color (state, state->preview_surface, state->last_point.x, state->last_point.y, x, y, state->eraser_size, color, state->antialiasing);
+  draw_eraser (state, state->preview_surface, color, x, y, state->eraser_size, state->antialiasing);
   state->last_point.x = x;
   state->last_point.y = y;
 }
@@ -61,7 +71,7 @@ draw_eraser_cursor (AppState *state, cairo_t *cr)
   double x = floor (state->cursor_x / pixel_size) * pixel_size;
   double y = floor (state->cursor_y / pixel_size) * pixel_size;
   cairo_save (cr);
-  draw_colored_square (cr, &state->secondary_color, x + 0.5 - state->eraser_size / 2, y + 0.5 - state->eraser_size / 2, state->eraser_size, state->eraser_size, pixel_size);
+  draw_colored_square (cr, eraser_get_color (state), x + 0.5 - state->eraser_size / 2, y + 0.5 - state->eraser_size / 2, state->eraser_size, state->eraser_size);
   cairo_restore (cr);
 
   /* gdk_cairo_set_source_rgba (cr, &state->secondary_color); */
@@ -1,9 +1,19 @@
 
 #include "tools-internal.h"
 
+// Strokes are repeated around a centre, mirrored across its axes or turned
+// around it. Every segment is transformed into all copies at once, which are
+// queued together and thus rasterized in a single pass.
+
+typedef struct
+{
+  double xx, xy, yx, yy; // Maps (x, y) relative to the centre to (xx * x + xy * y, yx * x + yy * y)
+} SymmetryTransform;
+
 static const struct raw_bitmap freehand_data; // TODO
 static void draw_symmetric_freehand_handler (AppState *state, gint x0, gint y0, gint x1, gint y1);
 static void motion_symmetric_freehand_handler (AppState *state, gint x, gint y);
+static void draw_symmetry_centre (AppState *state, cairo_t *cr);
 
 const Tool global_symmetric_freehand_tool = {
   .type = TOOL_SYMMETRIC_FREEHAND,
@@ -11,34 +21,156 @@ const Tool global_symmetric_freehand_tool = {
   .cursor_name = NULL,
   .draw_handler = draw_symmetric_freehand_handler,
   .motion_handler = motion_symmetric_freehand_handler,
+  .draw_cursor_handler = draw_symmetry_centre,
   .is_drawing = TRUE,
 };
 
+// The transforms of the current symmetry, the identity first. They only
+// change with the settings, so they are kept between events.
+static const SymmetryTransform *
+get_symmetry (AppState *state, guint *count)
+{
+  static SymmetryTransform transforms[SYMMETRY_MAX_COPIES];
+  static SymmetryMode mode;
+  static guint folds, n_transforms;
+
+  const guint wanted = CLAMP (state->symmetry_folds ? state->symmetry_folds : 2, 1, SYMMETRY_MAX_COPIES);
+
+  if (n_transforms == 0 || mode != state->symmetry_mode || (mode == SYMMETRY_RADIAL && folds != wanted))
+    {
+      mode = state->symmetry_mode;
+      folds = wanted;
+      n_transforms = 0;
+      transforms[n_transforms++] = (SymmetryTransform) { 1.0, 0.0, 0.0, 1.0 };
+
+      switch (mode)
+        {
+        case SYMMETRY_X:
+          transforms[n_transforms++] = (SymmetryTransform) { -1.0, 0.0, 0.0, 1.0 };
+          break;
+        case SYMMETRY_Y:
+          transforms[n_transforms++] = (SymmetryTransform) { 1.0, 0.0, 0.0, -1.0 };
+          break;
+        case SYMMETRY_XY:
+          transforms[n_transforms++] = (SymmetryTransform) { -1.0, 0.0, 0.0, 1.0 };
+          transforms[n_transforms++] = (SymmetryTransform) { 1.0, 0.0, 0.0, -1.0 };
+          transforms[n_transforms++] = (SymmetryTransform) { -1.0, 0.0, 0.0, -1.0 };
+          break;
+        case SYMMETRY_RADIAL:
+        default:
+          for (guint i = 1; i < folds; i++)
+            {
+              const double angle = 2.0 * G_PI * i / folds;
+              const double c = cos (angle), s = sin (angle);
+              transforms[n_transforms++] = (SymmetryTransform) { c, -s, s, c };
+            }
+          break;
+        }
+    }
+
+  *count = n_transforms;
+  return transforms;
+}
+
 static void
-draw_symmetric_freehand_handler (AppState *state, gint x0, gint y0, gint x1, gint y1)
+symmetry_centre (AppState *state, double *cx, double *cy)
+{
+  *cx = cairo_image_surface_get_width (state->main_surface) / 2.0 + state->symmetry_offset_x;
+  *cy = cairo_image_surface_get_height (state->main_surface) / 2.0 + state->symmetry_offset_y;
+}
+
+// Stores the segment from (x0, y0) to (x1, y1) in every copy as pairs of
+// points, which must have room for 2 * SYMMETRY_MAX_COPIES of them. Returns
+// the number of points stored.
+guint
+symmetric_segments (AppState *state, gint x0, gint y0, gint x1, gint y1, Point *points)
 {
-  handle_pixel (state->preview_surface, x1, y1, state->p_color, state->antialiasing);
+  guint count;
+  const SymmetryTransform *transforms = get_symmetry (state, &count);
+  double cx, cy;
 
-  int width = cairo_image_surface_get_width (state->main_surface);
-  int height = cairo_image_surface_get_height (state->main_surface);
+  symmetry_centre (state, &cx, &cy);
 
-  handle_pixel (state->preview_surface, width - x1 - 1, height - y1 - 1, state->p_color, state->antialiasing);
+  // Pixel centres are transformed, so the copies of a pixel are whole pixels
+  // as well when the symmetry allows.
+  const double u0 = x0 + 0.5 - cx, v0 = y0 + 0.5 - cy;
+  const double u1 = x1 + 0.5 - cx, v1 = y1 + 0.5 - cy;
+
+  for (guint i = 0; i < count; i++)
+    {
+      const SymmetryTransform *t = &transforms[i];
+
+      points[2 * i].x = (gint) floor (cx + t->xx * u0 + t->xy * v0);
+      points[2 * i].y = (gint) floor (cy + t->yx * u0 + t->yy * v0);
+      points[2 * i + 1].x = (gint) floor (cx + t->xx * u1 + t->xy * v1);
+      points[2 * i + 1].y = (gint) floor (cy + t->yx * u1 + t->yy * v1);
+    }
+
+  return 2 * count;
 }
 
+// Queues the segment from (x0, y0) to (x1, y1) in every copy.
 static void
-motion_symmetric_freehand_handler (AppState *state, gint x, gint y)
+draw_symmetric (AppState *state, gint x0, gint y0, gint x1, gint y1)
 {
-  draw_line_with_width_and_color (state->preview_surface, state->last_point.x, state->last_point.y, x, y, 1.0, state->p_color, state->antialiasing);
+  Point points[2 * SYMMETRY_MAX_COPIES];
+  const guint count = symmetric_segments (state, x0, y0, x1, y1, points);
 
-  int width = cairo_image_surface_get_width (state->main_surface);
-  int height = cairo_image_surface_get_height (state->main_surface);
+  tool_queue_lines (state, points, count, 1.0, state->p_color);
+}
 
-  draw_line_with_width_and_color (state->preview_surface, width - state->last_point.x - 1, height - state->last_point.y - 1, width - x - 1, height - y - 1, 1.0, state->p_color, state->antialiasing);
+static void
+draw_symmetric_freehand_handler (AppState *state, gint x0, gint y0, gint x1, gint y1)
+{
+  draw_symmetric (state, x1, y1, x1, y1);
+}
 
+static void
+motion_symmetric_freehand_handler (AppState *state, gint x, gint y)
+{
+  draw_symmetric (state, state->last_point.x, state->last_point.y, x, y);
   state->last_point.x = x;
   state->last_point.y = y;
 }
 
+// Marks the centre of symmetry, and the axes of mirror symmetries.
+static void
+draw_symmetry_centre (AppState *state, cairo_t *cr)
+{
+  const double zoom = state->zoom_level;
+  const double width = cairo_image_surface_get_width (state->main_surface) * zoom;
+  const double height = cairo_image_surface_get_height (state->main_surface) * zoom;
+  double cx, cy;
+
+  symmetry_centre (state, &cx, &cy);
+  cx = round (cx * zoom) + 0.5;
+  cy = round (cy * zoom) + 0.5;
+
+  cairo_set_line_width (cr, 1.0);
+  cairo_set_source_rgba (cr, 0.0, 0.5, 1.0, 0.6);
+
+  if (state->symmetry_mode == SYMMETRY_X || state->symmetry_mode == SYMMETRY_XY)
+    {
+      cairo_move_to (cr, cx, 0.0);
+      cairo_line_to (cr, cx, height);
+    }
+
+  if (state->symmetry_mode == SYMMETRY_Y || state->symmetry_mode == SYMMETRY_XY)
+    {
+      cairo_move_to (cr, 0.0, cy);
+      cairo_line_to (cr, width, cy);
+    }
+
+  cairo_stroke (cr);
+
+  cairo_set_source_rgb (cr, 0.0, 0.5, 1.0);
+  cairo_move_to (cr, cx - 6.0, cy);
+  cairo_line_to (cr, cx + 6.0, cy);
+  cairo_move_to (cr, cx, cy - 6.0);
+  cairo_line_to (cr, cx, cy + 6.0);
+  cairo_stroke (cr);
+}
+
 // clang-format off
 static const guchar freehand_bytes[] =
   {
@@ -1,18 +1,232 @@
+#include <stdlib.h>
+
 #include "tools-internal.h"
+#include "view.h"
+
+void
+tool_mark_dirty (AppState *state, const GdkRectangle *rect)
+{
+  preview_touch (state, rect);
+  gpaint_rectangle_union (&state->dirty_rect, rect);
+  view_invalidate (state, rect);
+}
+
+void
+tool_mark_path_dirty (AppState *state, cairo_t *cr, gboolean stroke)
+{
+  const GdkRectangle rect = gpaint_cairo_path_bounds (cr, stroke);
+  tool_mark_dirty (state, &rect);
+}
+
+// Without antialiasing, single pixels and lines one pixel wide are written
+// straight into the pixel buffer. Lines take the pixels Bresenham's
+// algorithm picks, exactly one per step along the major axis, which is what
+// pixel art wants and cheaper than building and stroking a path.
+static gboolean
+can_plot (cairo_surface_t *surface, gdouble width, cairo_antialias_t antialiasing)
+{
+  return antialiasing == CAIRO_ANTIALIAS_NONE && width == 1.0 && cairo_image_surface_get_format (surface) == CAIRO_FORMAT_ARGB32;
+}
+
+// Sets the pixels of the line from (x0, y0) to (x1, y1) within the surface
+// data to clr.
+static void
+plot_pixels (guchar *data, int stride, int width, int height, gint x0, gint y0, gint x1, gint y1, guint32 clr)
+{
+  const int dx = abs (x1 - x0);
+  const int dy = -abs (y1 - y0);
+  const int sx = x0 < x1 ? 1 : -1;
+  const int sy = y0 < y1 ? 1 : -1;
+  int error = dx + dy;
+
+  for (;;)
+    {
+      if (x0 >= 0 && x0 < width && y0 >= 0 && y0 < height)
+        ((guint32 *) (data + (gsize) y0 * stride))[x0] = clr;
+
+      if (x0 == x1 && y0 == y1)
+        break;
+
+      const int e2 = 2 * error;
+
+      if (e2 >= dy)
+        {
+          error += dy;
+          x0 += sx;
+        }
+
+      if (e2 <= dx)
+        {
+          error += dx;
+          y0 += sy;
+        }
+    }
+}
+
+// Plots the lines between each pair of points, whose bounds the caller has
+// marked dirty.
+static void
+plot_lines (cairo_surface_t *surface, const Point *points, guint count, const GdkRectangle *bounds, const GdkRGBA *color)
+{
+  const int width = cairo_image_surface_get_width (surface);
+  const int height = cairo_image_surface_get_height (surface);
+  const GdkRectangle canvas = { 0, 0, width, height };
+  GdkRectangle rect;
+
+  if (!gdk_rectangle_intersect (bounds, &canvas, &rect))
+    return;
+
+  cairo_surface_flush (surface);
+
+  guchar *data = cairo_image_surface_get_data (surface);
+  const int stride = cairo_image_surface_get_stride (surface);
+  const guint32 clr = gdk_rgba_to_premultiplied_clr (color);
+
+  for (guint i = 0; i + 1 < count; i += 2)
+    plot_pixels (data, stride, width, height, points[i].x, points[i].y, points[i + 1].x, points[i + 1].y, clr);
+
+  cairo_surface_mark_dirty_rectangle (surface, rect.x, rect.y, rect.width, rect.height);
+}
+
+static void
+plot_line (AppState *state, cairo_surface_t *surface, gint x0, gint y0, gint x1, gint y1, const GdkRGBA *color)
+{
+  const Point points[] = { { x0, y0 }, { x1, y1 } };
+  const GdkRectangle rect = {
+    min_int (x0, x1), min_int (y0, y1),
+    abs (x1 - x0) + 1, abs (y1 - y0) + 1,
+  };
+
+  tool_mark_dirty (state, &rect);
+  plot_lines (surface, points, countof (points), &rect, color);
+}
 
 void
-handle_pixel (cairo_surface_t *surface, gint x, gint y, const GdkRGBA *color, cairo_antialias_t antialiasing)
+handle_pixel (AppState *state, cairo_surface_t *surface, gint x, gint y, const GdkRGBA *color, cairo_antialias_t antialiasing)
 {
+  if (can_plot (surface, 1.0, antialiasing))
+    {
+      plot_line (state, surface, x, y, x, y, color);
+      return;
+    }
+
   cairo_t *cr = create_cairo (surface, CAIRO_OPERATOR_SOURCE, antialiasing);
   gdk_cairo_set_source_rgba (cr, color);
   cairo_rectangle (cr, x, y, 1, 1);
+  tool_mark_dirty (state, &(GdkRectangle) { x, y, 1, 1 });
   cairo_fill (cr);
   cairo_destroy (cr);
 }
 
+// Freehand strokes get a short segment per motion event, hundreds per second
+// with a fast pen, and symmetric strokes several. Rather than being stroked
+// one by one, the segments are collected into the path of a context kept for
+// the whole stroke and stroked together once per frame, by
+// tool_flush_lines(). Aliased lines one pixel wide are cheap enough to plot
+// right away.
+//
+// Queues the lines between each pair of points.
+void
+tool_queue_lines (AppState *state, const Point *points, guint count, gdouble width, const GdkRGBA *color)
+{
+  cairo_t *cr = state->lines_cr;
+  double red, green, blue, alpha;
+
+  if (count < 2)
+    return;
+
+  // Each segment with its round caps, and a pixel of margin for
+  // antialiasing. The segments are marked one by one, so copies far apart
+  // do not dirty everything between them.
+  const int radius = (int) ceil (width / 2.0) + 1;
+  GdkRectangle bounds;
+
+  for (guint i = 0; i + 1 < count; i += 2)
+    {
+      const GdkRectangle rect = {
+        min_int (points[i].x, points[i + 1].x) - radius,
+        min_int (points[i].y, points[i + 1].y) - radius,
+        abs (points[i + 1].x - points[i].x) + 2 * radius + 1,
+        abs (points[i + 1].y - points[i].y) + 2 * radius + 1,
+      };
+
+      tool_mark_dirty (state, &rect);
+
+      if (i == 0)
+        bounds = rect;
+      else
+        gdk_rectangle_union (&bounds, &rect, &bounds);
+    }
+
+  if (can_plot (state->preview_surface, width, state->antialiasing))
+    {
+      tool_flush_lines (state);
+      plot_lines (state->preview_surface, points, count, &bounds, color);
+      return;
+    }
+
+  if (cr && (cairo_get_line_width (cr) != width
+             || cairo_get_antialias (cr) != state->antialiasing
+             || cairo_pattern_get_rgba (cairo_get_source (cr), &red, &green, &blue, &alpha) != CAIRO_STATUS_SUCCESS
+             || red != color->red || green != color->green || blue != color->blue || alpha != color->alpha))
+    {
+      tool_flush_lines (state);
+      tool_drop_lines (state);
+      cr = NULL;
+    }
+
+  if (!cr)
+    {
+      cr = state->lines_cr = create_cairo (state->preview_surface, CAIRO_OPERATOR_SOURCE, state->antialiasing);
+      cairo_set_line_width (cr, width);
+      cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
+      cairo_set_line_join (cr, CAIRO_LINE_JOIN_ROUND);
+      gdk_cairo_set_source_rgba (cr, color);
+    }
+
+  for (guint i = 0; i + 1 < count; i += 2)
+    {
+      double x, y;
+
+      if (!cairo_has_current_point (cr) || (cairo_get_current_point (cr, &x, &y), x != points[i].x + 0.5 || y != points[i].y + 0.5))
+        cairo_move_to (cr, points[i].x + 0.5, points[i].y + 0.5);
+
+      cairo_line_to (cr, points[i + 1].x + 0.5, points[i + 1].y + 0.5);
+    }
+}
+
+void
+tool_queue_line (AppState *state, gint x0, gint y0, gint x1, gint y1, gdouble width, const GdkRGBA *color)
+{
+  const Point points[] = { { x0, y0 }, { x1, y1 } };
+
+  tool_queue_lines (state, points, countof (points), width, color);
+}
+
+// Draws the queued lines. The context stays for the rest of the stroke.
+void
+tool_flush_lines (AppState *state)
+{
+  if (state->lines_cr && cairo_has_current_point (state->lines_cr))
+    cairo_stroke (state->lines_cr);
+}
+
+// Forgets the lines of the stroke, drawn or not.
+void
+tool_drop_lines (AppState *state)
+{
+  g_clear_pointer (&state->lines_cr, cairo_destroy);
+}
+
 void // TODO rename
-draw_line_with_width_and_color (cairo_surface_t *surface, gint x0, gint y0, gint x1, gint y1, gdouble width, const GdkRGBA *color, cairo_antialias_t antialiasing)
+draw_line_with_width_and_color (AppState *state, cairo_surface_t *surface, gint x0, gint y0, gint x1, gint y1, gdouble width, const GdkRGBA *color, cairo_antialias_t antialiasing)
 {
+  if (can_plot (surface, width, antialiasing))
+    {
+      plot_line (state, surface, x0, y0, x1, y1, color);
+      return;
+    }
+
   cairo_t *cr = create_cairo (surface, CAIRO_OPERATOR_SOURCE, antialiasing);
   cairo_set_line_width (cr, width);
   cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
@@ -22,6 +236,7 @@ draw_line_with_width_and_color (cairo_surface_t *surface, gint x0, gint y0, gint
   gdk_cairo_set_source_rgba (cr, color);
   // cairo_set_antialias(cr, CAIRO_ANTIALIAS_BILINEAR); // Enable bilinear
   // anti-aliasing
+  tool_mark_path_dirty (state, cr, TRUE);
   cairo_stroke (cr);
   cairo_destroy (cr);
 
@@ -4,6 +4,15 @@
 #include "tools-icons.h"
 #include "tools.h"
 
-extern void handle_pixel (cairo_surface_t *surface, gint x, gint y, const GdkRGBA *color, cairo_antialias_t antialiasing);
+#include "preview.h"
+
+// Tools report every area of the preview before they draw to it, so only
+// that part has to be prepared, composited, recorded and redrawn.
+extern void tool_mark_dirty (AppState *state, const GdkRectangle *rect);
+extern void tool_mark_path_dirty (AppState *state, cairo_t *cr, gboolean stroke);
+
+extern void handle_pixel (AppState *state, cairo_surface_t *surface, gint x, gint y, const GdkRGBA *color, cairo_antialias_t antialiasing);
+extern void tool_queue_lines (AppState *state, const Point *points, guint count, gdouble width, const GdkRGBA *color);
+extern void tool_queue_line (AppState *state, gint x0, gint y0, gint x1, gint y1, gdouble width, const GdkRGBA *color);
 // TODO rename
-extern void draw_line_with_width_and_color (cairo_surface_t *surface, gint x0, gint y0, gint x1, gint y1, gdouble width, const GdkRGBA *color, cairo_antialias_t antialiasing);
+extern void draw_line_with_width_and_color (AppState *state, cairo_surface_t *surface, gint x0, gint y0, gint x1, gint y1, gdouble width, const GdkRGBA *color, cairo_antialias_t antialiasing);
@@ -61,3 +61,16 @@ extern const Tool global_picker_tool;
 extern const Tool global_bucket_tool;
 extern const Tool global_drag_tool;
 extern const Tool global_symmetric_freehand_tool;
+
+enum
+{
+  SYMMETRY_MAX_COPIES = 64,
+};
+
+extern guint symmetric_segments (AppState *state, gint x0, gint y0, gint x1, gint y1, Point *points);
+extern void tool_flush_lines (AppState *state);
+extern void tool_drop_lines (AppState *state);
+extern void free_brush_masks (void);
+extern void free_fill_pool (void);
+extern void brush_draw_tail (AppState *state, cairo_t *cr, gint x, gint y);
+extern const GdkRGBA *eraser_get_color (AppState *state);
@@ -115,6 +115,7 @@ draw_triangle_handler (AppState *state,
   cairo_line_to (cr, x0, y0);
 
   // Render the stroke and clear the path in one go
+  tool_mark_path_dirty (state, cr, TRUE);
   cairo_stroke (cr);
 }
 
@@ -0,0 +1,495 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "backup.h"
+#include "mipmap.h"
+#include "preview.h"
+#include "stroke.h"
+#include "trace.h"
+#include "tools/tools.h"
+#include "view.h"
+
+// Recording of the pointer input handled on the canvas, to replay drawings
+// without a window when profiling. Every function accepts a NULL Trace and
+// does nothing then.
+//
+// A trace file starts with a header: the magic "GPTR", the format version
+// and the canvas size. It is followed by records, each a type byte and its
+// payload; all numbers are little endian.
+//
+//   TRACE_PRESS, TRACE_MOTION, TRACE_RELEASE, TRACE_CANCEL:
+//     u32 microseconds since the previous record, i32 x, i32 y
+//   TRACE_UNDO, TRACE_REDO:
+//     u32 microseconds since the previous record
+//   TRACE_SETTINGS:
+//     u8 tool, u8 fill type, u8 antialiasing, u8 flags, u32 primary color,
+//     u32 secondary color, f32 width, f32 brush size, f32 eraser size,
+//     u32 fill tolerance, u8 brush shape, u8 symmetry mode, u32 symmetry
+//     folds, f32 brush softness, f32 symmetry centre x and y offsets
+//   TRACE_CANVAS:
+//     i32 width, i32 height
+//
+// Settings are written before a press whenever they changed since the
+// previous one. Only the size of a canvas is recorded, not its content.
+
+#define TRACE_MAGIC "GPTR"
+
+enum
+{
+  TRACE_VERSION = 2,
+
+  TRACE_HEADER_SIZE = 12,
+  TRACE_POINT_SIZE = 12,
+  TRACE_TIME_SIZE = 4,
+  TRACE_SETTINGS_SIZE = 46,
+  TRACE_CANVAS_SIZE = 8,
+  TRACE_RECORD_MAX = 1 + TRACE_SETTINGS_SIZE,
+  TRACE_CANVAS_MAX = 32767, // Largest image surface cairo creates
+
+  TRACE_SWAPPED = 1 << 0, // The stroke draws with the secondary color
+  TRACE_FILL_GLOBAL = 1 << 1,
+};
+
+struct _Trace
+{
+  FILE *file;
+  gint64 last; // Time of the previous record
+  guint8 settings[TRACE_SETTINGS_SIZE]; // As last written
+  gboolean has_settings;
+  gint width, height; // Canvas size as last written
+};
+
+static const Tool *const trace_tools[TOOLS_COUNT] = {
+  [TOOL_SELECT_RECTANGLE] = &global_select_rectangle_tool,
+  [TOOL_FREEHAND] = &global_freehand_tool,
+  [TOOL_BRUSH] = &global_brush_tool,
+  [TOOL_PICKER] = &global_picker_tool,
+  [TOOL_BUCKET] = &global_bucket_tool,
+  [TOOL_LINE] = &global_line_tool,
+  [TOOL_RECTANGLE] = &global_rectangle_tool,
+  [TOOL_ELLIPSE] = &global_ellipse_tool,
+  [TOOL_TRIANGLE] = &global_triangle_tool,
+  [TOOL_ERASER] = &global_eraser_tool,
+  [TOOL_DRAG] = &global_drag_tool,
+  [TOOL_SYMMETRIC_FREEHAND] = &global_symmetric_freehand_tool,
+};
+
+static guint8 *
+put_u32 (guint8 *p, guint32 value)
+{
+  value = GUINT32_TO_LE (value);
+  memcpy (p, &value, sizeof (value));
+  return p + sizeof (value);
+}
+
+static guint8 *
+put_f32 (guint8 *p, float value)
+{
+  guint32 bits;
+
+  memcpy (&bits, &value, sizeof (bits));
+  return put_u32 (p, bits);
+}
+
+static guint32
+get_u32 (const guint8 **p)
+{
+  guint32 value;
+
+  memcpy (&value, *p, sizeof (value));
+  *p += sizeof (value);
+  return GUINT32_FROM_LE (value);
+}
+
+static float
+get_f32 (const guint8 **p)
+{
+  const guint32 bits = get_u32 (p);
+  float value;
+
+  memcpy (&value, &bits, sizeof (value));
+  return value;
+}
+
+static guint8 *
+put_canvas (guint8 *p, cairo_surface_t *surface)
+{
+  p = put_u32 (p, (guint32) cairo_image_surface_get_width (surface));
+  return put_u32 (p, (guint32) cairo_image_surface_get_height (surface));
+}
+
+static void
+pack_settings (guint8 *p, AppState *state)
+{
+  const gboolean swapped = state->p_color == &state->secondary_color;
+
+  *p++ = (guint8) state->tool->type;
+  *p++ = (guint8) state->fill_type;
+  *p++ = (guint8) state->antialiasing;
+  *p++ = (swapped ? TRACE_SWAPPED : 0) | (state->fill_global ? TRACE_FILL_GLOBAL : 0);
+  p = put_u32 (p, gdk_rgba_to_clr (&state->primary_color));
+  p = put_u32 (p, gdk_rgba_to_clr (&state->secondary_color));
+  p = put_f32 (p, (float) state->width);
+  p = put_f32 (p, (float) state->brush_size);
+  p = put_f32 (p, (float) state->eraser_size);
+  p = put_u32 (p, state->fill_tolerance);
+  *p++ = (guint8) state->brush_shape;
+  *p++ = (guint8) state->symmetry_mode;
+  p = put_u32 (p, state->symmetry_folds);
+  p = put_f32 (p, (float) state->brush_softness);
+  p = put_f32 (p, (float) state->symmetry_offset_x);
+  put_f32 (p, (float) state->symmetry_offset_y);
+}
+
+static GdkRGBA
+clr_to_gdk_rgba (guint32 clr)
+{
+  return (GdkRGBA) {
+    .red = ((clr >> 16) & 0xff) / 255.0,
+    .green = ((clr >> 8) & 0xff) / 255.0,
+    .blue = (clr & 0xff) / 255.0,
+    .alpha = (clr >> 24) / 255.0,
+  };
+}
+
+// Applies the settings to state, unless any of them is out of range.
+static gboolean
+unpack_settings (const guint8 *p, AppState *state)
+{
+  const guint8 type = p[0];
+  const guint8 fill_type = p[1];
+  const guint8 antialiasing = p[2];
+  const guint8 flags = p[3];
+  const guint8 brush_shape = p[28];
+  const guint8 symmetry_mode = p[29];
+
+  if (type >= TOOLS_COUNT || !trace_tools[type]
+      || fill_type > FILL_SECONDARY
+      || antialiasing > CAIRO_ANTIALIAS_BEST
+      || brush_shape > BRUSH_SHAPE_SQUARE
+      || symmetry_mode > SYMMETRY_XY)
+    return FALSE;
+
+  p += 4;
+
+  const guint32 primary = get_u32 (&p);
+  const guint32 secondary = get_u32 (&p);
+  const float width = get_f32 (&p);
+  const float brush_size = get_f32 (&p);
+  const float eraser_size = get_f32 (&p);
+  const guint32 fill_tolerance = get_u32 (&p);
+
+  p += 2;
+
+  const guint32 symmetry_folds = get_u32 (&p);
+  const float brush_softness = get_f32 (&p);
+  const float offset_x = get_f32 (&p);
+  const float offset_y = get_f32 (&p);
+
+  if (!isfinite (width) || !isfinite (brush_size) || !isfinite (eraser_size)
+      || !isfinite (brush_softness) || !isfinite (offset_x) || !isfinite (offset_y)
+      || symmetry_folds > SYMMETRY_MAX_COPIES)
+    return FALSE;
+
+  state->tool = trace_tools[type];
+  state->fill_type = (FillType) fill_type;
+  state->antialiasing = (cairo_antialias_t) antialiasing;
+  state->primary_color = clr_to_gdk_rgba (primary);
+  state->secondary_color = clr_to_gdk_rgba (secondary);
+  state->p_color = flags & TRACE_SWAPPED ? &state->secondary_color : &state->primary_color;
+  state->s_color = flags & TRACE_SWAPPED ? &state->primary_color : &state->secondary_color;
+  state->fill_global = (flags & TRACE_FILL_GLOBAL) != 0;
+  state->width = width;
+  state->brush_size = brush_size;
+  state->eraser_size = eraser_size;
+  state->fill_tolerance = fill_tolerance;
+  state->brush_shape = (BrushShape) brush_shape;
+  state->symmetry_mode = (SymmetryMode) symmetry_mode;
+  state->symmetry_folds = symmetry_folds;
+  state->brush_softness = brush_softness;
+  state->symmetry_offset_x = offset_x;
+  state->symmetry_offset_y = offset_y;
+  return TRUE;
+}
+
+// Starts recording into a new file at path, which is replaced if it exists.
+// Returns NULL if it cannot be created.
+Trace *
+trace_new (const gchar *path, AppState *state)
+{
+  guint8 header[TRACE_HEADER_SIZE];
+  guint8 *p = header;
+  FILE *file = fopen (path, "wb");
+
+  if (!file)
+    {
+      g_printerr ("Failed to open %s: %s\n", path, g_strerror (errno));
+      return NULL;
+    }
+
+  memcpy (p, TRACE_MAGIC, 4);
+  p += 4;
+  *p++ = TRACE_VERSION;
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = 0;
+  put_canvas (p, state->main_surface);
+  fwrite (header, 1, sizeof (header), file);
+
+  Trace *trace = g_new0 (Trace, 1);
+  trace->file = file;
+  trace->last = g_get_monotonic_time ();
+  trace->width = cairo_image_surface_get_width (state->main_surface);
+  trace->height = cairo_image_surface_get_height (state->main_surface);
+  return trace;
+}
+
+void
+trace_free (Trace *trace)
+{
+  if (!trace)
+    return;
+
+  fclose (trace->file);
+  g_free (trace);
+}
+
+// Appends event at (x, y) in canvas pixels. Presses also record the canvas
+// size and the settings of the stroke if they changed.
+void
+trace_record (Trace *trace, AppState *state, TraceEvent event, gint x, gint y)
+{
+  guint8 record[TRACE_RECORD_MAX];
+  guint8 *p = record;
+
+  if (!trace)
+    return;
+
+  if (event == TRACE_PRESS)
+    {
+      const gint width = cairo_image_surface_get_width (state->main_surface);
+      const gint height = cairo_image_surface_get_height (state->main_surface);
+      guint8 settings[TRACE_SETTINGS_SIZE];
+
+      if (width != trace->width || height != trace->height)
+        {
+          *p++ = TRACE_CANVAS;
+          p = put_canvas (p, state->main_surface);
+          fwrite (record, 1, p - record, trace->file);
+          p = record;
+          trace->width = width;
+          trace->height = height;
+        }
+
+      pack_settings (settings, state);
+
+      if (!trace->has_settings || memcmp (settings, trace->settings, sizeof (settings)) != 0)
+        {
+          *p++ = TRACE_SETTINGS;
+          memcpy (p, settings, sizeof (settings));
+          fwrite (record, 1, 1 + sizeof (settings), trace->file);
+          p = record;
+          memcpy (trace->settings, settings, sizeof (settings));
+          trace->has_settings = TRUE;
+        }
+    }
+
+  const gint64 now = g_get_monotonic_time ();
+
+  *p++ = (guint8) event;
+  p = put_u32 (p, (guint32) MIN (now - trace->last, G_MAXUINT32));
+  trace->last = now;
+
+  if (event != TRACE_UNDO && event != TRACE_REDO)
+    {
+      p = put_u32 (p, (guint32) x);
+      p = put_u32 (p, (guint32) y);
+    }
+
+  fwrite (record, 1, p - record, trace->file);
+}
+
+// Replaces the canvas of state, and its history, with a blank one.
+static void
+replay_new_canvas (AppState *state, gint width, gint height)
+{
+  free_backup_manager (&state->backup_manager);
+  free_preview (state);
+  free_view (state);
+  free_mipmap (state);
+  g_clear_pointer (&state->main_surface, cairo_surface_destroy);
+
+  state->main_surface = create_surface (width, height);
+  init_backup_manager (&state->backup_manager, state->main_surface);
+}
+
+// Canvas sizes are stored unsigned; anything cairo can not create is corrupt.
+static gboolean
+valid_canvas_size (guint32 width, guint32 height)
+{
+  return width > 0 && height > 0 && width <= TRACE_CANVAS_MAX && height <= TRACE_CANVAS_MAX;
+}
+
+static gsize
+record_size (guint8 event)
+{
+  switch (event)
+    {
+    case TRACE_PRESS:
+    case TRACE_MOTION:
+    case TRACE_RELEASE:
+    case TRACE_CANCEL:
+      return TRACE_POINT_SIZE;
+    case TRACE_UNDO:
+    case TRACE_REDO:
+      return TRACE_TIME_SIZE;
+    case TRACE_SETTINGS:
+      return TRACE_SETTINGS_SIZE;
+    case TRACE_CANVAS:
+      return TRACE_CANVAS_SIZE;
+    default:
+      return 0;
+    }
+}
+
+// Feeds the trace at path to the tools of state, whose canvas is replaced by
+// a blank one of the recorded size. If paced, waits between the events as
+// long as the user did. Strokes of the picker, drag and selection tools are
+// skipped, as those need a window.
+gboolean
+trace_replay (AppState *state, const gchar *path, gboolean paced, TraceReplayStats *stats, GError **error)
+{
+  g_autofree gchar *contents = NULL;
+  gsize length;
+  gboolean skipping = FALSE;
+
+  *stats = (TraceReplayStats) { 0 };
+
+  if (!g_file_get_contents (path, &contents, &length, error))
+    return FALSE;
+
+  const guint8 *p = (const guint8 *) contents;
+  const guint8 *end = p + length;
+
+  if (length < TRACE_HEADER_SIZE || memcmp (p, TRACE_MAGIC, 4) != 0 || p[4] != TRACE_VERSION)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is not a gpaint trace", path);
+      return FALSE;
+    }
+
+  p += 8;
+
+  const guint32 width = get_u32 (&p);
+  const guint32 height = get_u32 (&p);
+
+  if (!valid_canvas_size (width, height))
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is corrupt at byte %d", path, 8);
+      return FALSE;
+    }
+
+  replay_new_canvas (state, (gint) width, (gint) height);
+
+  while (p < end)
+    {
+      const guint8 event = *p++;
+      const gsize size = record_size (event);
+
+      if (size == 0 || (gsize) (end - p) < size)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is corrupt at byte %" G_GSIZE_FORMAT, path, (gsize) (p - 1 - (const guint8 *) contents));
+          return FALSE;
+        }
+
+      const guint8 *record = p;
+      const gsize offset = (gsize) (record - (const guint8 *) contents);
+      p += size;
+
+      if (event == TRACE_SETTINGS)
+        {
+          if (!unpack_settings (record, state))
+            {
+              g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is corrupt at byte %" G_GSIZE_FORMAT, path, offset);
+              return FALSE;
+            }
+
+          continue;
+        }
+
+      if (event == TRACE_CANVAS)
+        {
+          const guint32 canvas_width = get_u32 (&record);
+          const guint32 canvas_height = get_u32 (&record);
+
+          if (!valid_canvas_size (canvas_width, canvas_height))
+            {
+              g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is corrupt at byte %" G_GSIZE_FORMAT, path, offset);
+              return FALSE;
+            }
+
+          replay_new_canvas (state, (gint) canvas_width, (gint) canvas_height);
+          continue;
+        }
+
+      const guint32 delay = get_u32 (&record);
+
+      if (paced)
+        g_usleep (delay);
+
+      gint x = 0, y = 0;
+
+      if (event != TRACE_UNDO && event != TRACE_REDO)
+        {
+          x = (gint) get_u32 (&record);
+          y = (gint) get_u32 (&record);
+        }
+
+      if (event == TRACE_PRESS)
+        skipping = state->tool->type == TOOL_PICKER || state->tool->type == TOOL_DRAG || state->tool->type == TOOL_SELECT_RECTANGLE;
+
+      if (skipping && event != TRACE_UNDO && event != TRACE_REDO)
+        {
+          stats->skipped += event == TRACE_PRESS;
+          continue;
+        }
+
+      const gint64 start = g_get_monotonic_time ();
+
+      switch ((TraceEvent) event)
+        {
+        case TRACE_PRESS:
+          stroke_begin (state, x, y);
+          stats->strokes++;
+          break;
+        case TRACE_MOTION:
+          stroke_motion (state, x, y);
+          break;
+        case TRACE_RELEASE:
+          stroke_end (state);
+          break;
+        case TRACE_CANCEL:
+          stroke_cancel (state);
+          break;
+        case TRACE_UNDO:
+          move_backward (&state->backup_manager, state);
+          break;
+        case TRACE_REDO:
+          move_forward (&state->backup_manager, state);
+          break;
+        case TRACE_SETTINGS:
+        case TRACE_CANVAS:
+        default:
+          break;
+        }
+
+      stats->busy += g_get_monotonic_time () - start;
+      stats->events++;
+    }
+
+  if (state->is_drawing)
+    stroke_end (state);
+
+  return TRUE;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <glib.h>
+
+#include "gpaint.h"
+
+typedef enum
+{
+  TRACE_PRESS = 1,
+  TRACE_MOTION,
+  TRACE_RELEASE,
+  TRACE_CANCEL,
+  TRACE_UNDO,
+  TRACE_REDO,
+  TRACE_SETTINGS, // Tool, colors and sizes for the following strokes
+  TRACE_CANVAS,   // Blank canvas of a new size
+} TraceEvent;
+
+typedef struct _Trace Trace;
+
+typedef struct
+{
+  guint events;
+  guint strokes;
+  guint skipped; // Strokes of tools which need a window
+  gint64 busy;   // Microseconds spent handling the events
+} TraceReplayStats;
+
+extern Trace *trace_new (const gchar *path, AppState *state);
+extern void trace_free (Trace *trace);
+extern void trace_record (Trace *trace, AppState *state, TraceEvent event, gint x, gint y);
+
+extern gboolean trace_replay (AppState *state, const gchar *path, gboolean paced, TraceReplayStats *stats, GError **error);
@@ -0,0 +1,354 @@
+#include <math.h>
+
+#include "frame-stats.h"
+#include "mipmap.h"
+#include "view.h"
+
+// The visible part of the canvas is composited into a backing store kept
+// between frames. Changes to the canvas are reported as damaged rectangles
+// and only these parts are composited again; a frame itself is a single copy
+// of the backing store, with overlays such as the cursor drawn on top.
+//
+// With GTK 4.10 and newer the canvas is presented as textures instead, one
+// per tile of the canvas, so the renderer can keep them between frames. Only
+// tiles with damaged pixels are composited and uploaded again. The background
+// and the grid are repeat nodes.
+
+enum
+{
+  VIEW_TILE_SIZE = 256,
+};
+
+static int
+view_tile_count (int size)
+{
+  return (size + VIEW_TILE_SIZE - 1) / VIEW_TILE_SIZE;
+}
+
+static void
+view_free_tiles (AppState *state)
+{
+  const int count = view_tile_count (state->view_tiles_width) * view_tile_count (state->view_tiles_height);
+
+  if (!state->view_tiles)
+    return;
+
+  for (int i = 0; i < count; i++)
+    g_clear_object (&state->view_tiles[i]);
+
+  g_clear_pointer (&state->view_tiles, g_free);
+  state->view_tiles_width = state->view_tiles_height = 0;
+}
+
+// Drops the textures of the tiles overlapping rect, or of all tiles if rect
+// is NULL.
+static void
+view_damage_tiles (AppState *state, const GdkRectangle *rect)
+{
+  const int columns = view_tile_count (state->view_tiles_width);
+  const int rows = view_tile_count (state->view_tiles_height);
+  GdkRectangle area = { 0, 0, state->view_tiles_width, state->view_tiles_height };
+
+  if (!state->view_tiles || (rect && !gdk_rectangle_intersect (rect, &area, &area)))
+    return;
+
+  for (int row = area.y / VIEW_TILE_SIZE; row < min_int (rows, view_tile_count (area.y + area.height)); row++)
+    for (int column = area.x / VIEW_TILE_SIZE; column < min_int (columns, view_tile_count (area.x + area.width)); column++)
+      g_clear_object (&state->view_tiles[row * columns + column]);
+}
+
+static void
+view_get_area (AppState *state, GdkRectangle *area)
+{
+  const double x = gtk_adjustment_get_value (state->hadj);
+  const double y = gtk_adjustment_get_value (state->vadj);
+
+  area->x = (int) floor (x);
+  area->y = (int) floor (y);
+  area->width = (int) ceil (x + gtk_adjustment_get_page_size (state->hadj)) - area->x;
+  area->height = (int) ceil (y + gtk_adjustment_get_page_size (state->vadj)) - area->y;
+}
+
+static cairo_surface_t *
+view_create_surface (const GdkRectangle *area, int scale)
+{
+  cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, area->width * scale, area->height * scale);
+  cairo_surface_set_device_scale (surface, scale, scale);
+  return surface;
+}
+
+static void
+view_add_damage (AppState *state, const GdkRectangle *rect)
+{
+  const double zoom = state->zoom_level;
+
+  mipmap_invalidate (state, rect);
+
+  if (state->view_textured)
+    {
+      view_damage_tiles (state, rect);
+      return;
+    }
+
+  if (!state->view_damage)
+    state->view_damage = cairo_region_create ();
+
+  if (!rect)
+    cairo_region_union_rectangle (state->view_damage, &state->view_area);
+  else if (rect->width > 0 && rect->height > 0)
+    {
+      // Grid lines straddle pixel edges, so one more widget pixel is
+      // damaged on each side.
+      const int left = (int) floor (rect->x * zoom) - 1;
+      const int top = (int) floor (rect->y * zoom) - 1;
+      const int right = (int) ceil ((rect->x + rect->width) * zoom) + 1;
+      const int bottom = (int) ceil ((rect->y + rect->height) * zoom) + 1;
+      const GdkRectangle area = { left, top, right - left, bottom - top };
+
+      cairo_region_union_rectangle (state->view_damage, &area);
+    }
+}
+
+// Marks rect of the canvas, or the whole canvas if rect is NULL, to be
+// composited again on the next frame.
+void
+view_invalidate (AppState *state, const GdkRectangle *rect)
+{
+  view_add_damage (state, rect);
+
+  // Tools also run without a window, e.g. in benchmarks.
+  if (state->drawing_area)
+    gtk_widget_queue_draw (state->drawing_area);
+}
+
+// The floating selection is moved, pasted and dropped in many places, so it
+// is tracked when a frame is drawn rather than at each of them.
+static void
+view_track_selection (AppState *state)
+{
+  const GdkRectangle selection = state->selected_surface ? state->selected_rect : (GdkRectangle) { 0, 0, 0, 0 };
+
+  if (!gdk_rectangle_equal (&selection, &state->view_selection))
+    {
+      view_add_damage (state, &state->view_selection);
+      view_add_damage (state, &selection);
+      state->view_selection = selection;
+    }
+}
+
+// Brings the damaged parts of the backing store up to date with draw_canvas
+// and paints it to cr.
+void
+view_draw (AppState *state, cairo_t *cr, ViewDrawFunc draw_canvas)
+{
+  const int scale = gtk_widget_get_scale_factor (state->drawing_area);
+  GdkRectangle area;
+
+  view_get_area (state, &area);
+
+  if (area.width <= 0 || area.height <= 0)
+    return;
+
+  if (!state->view_damage)
+    state->view_damage = cairo_region_create ();
+
+  view_track_selection (state);
+
+  if (!state->view_surface
+      || state->view_zoom != state->zoom_level
+      || state->view_scale != scale
+      || state->view_area.width != area.width
+      || state->view_area.height != area.height)
+    {
+      g_clear_pointer (&state->view_surface, cairo_surface_destroy);
+      state->view_surface = view_create_surface (&area, scale);
+      state->view_zoom = state->zoom_level;
+      state->view_scale = scale;
+      state->view_area = area;
+      cairo_region_union_rectangle (state->view_damage, &area);
+    }
+  else if (state->view_area.x != area.x || state->view_area.y != area.y)
+    {
+      // Scrolled: what stays visible is moved, only the uncovered part is
+      // composited.
+      cairo_surface_t *surface = view_create_surface (&area, scale);
+      cairo_t *scr = create_cairo (surface, CAIRO_OPERATOR_SOURCE, CAIRO_ANTIALIAS_NONE);
+      cairo_set_source_surface (scr, state->view_surface, state->view_area.x - area.x, state->view_area.y - area.y);
+      cairo_paint (scr);
+      cairo_destroy (scr);
+
+      cairo_region_t *exposed = cairo_region_create_rectangle (&area);
+      cairo_region_subtract_rectangle (exposed, &state->view_area);
+      cairo_region_union (state->view_damage, exposed);
+      cairo_region_destroy (exposed);
+
+      cairo_surface_destroy (state->view_surface);
+      state->view_surface = surface;
+      state->view_area = area;
+    }
+
+  cairo_region_intersect_rectangle (state->view_damage, &area);
+
+  if (!cairo_region_is_empty (state->view_damage))
+    {
+      cairo_t *vcr = create_cairo (state->view_surface, CAIRO_OPERATOR_CLEAR, CAIRO_ANTIALIAS_DEFAULT);
+      cairo_translate (vcr, -area.x, -area.y);
+      gdk_cairo_region (vcr, state->view_damage);
+      cairo_clip (vcr);
+      cairo_paint (vcr);
+      cairo_set_operator (vcr, CAIRO_OPERATOR_OVER);
+      draw_canvas (state, vcr);
+      cairo_destroy (vcr);
+
+      cairo_region_destroy (state->view_damage);
+      state->view_damage = cairo_region_create ();
+    }
+
+  cairo_save (cr);
+  cairo_set_source_surface (cr, state->view_surface, area.x, area.y);
+  cairo_paint (cr);
+  cairo_restore (cr);
+}
+
+#if GTK_CHECK_VERSION (4, 10, 0)
+// Composites a tile at the resolution of the mipmap level of the tiles.
+static GdkTexture *
+view_create_tile (AppState *state, int column, int row, ViewDrawFunc draw_layers)
+{
+  const int shift = state->view_tiles_level;
+  const int x = column * VIEW_TILE_SIZE;
+  const int y = row * VIEW_TILE_SIZE;
+  const int width = (min_int (VIEW_TILE_SIZE, state->view_tiles_width - x) + (1 << shift) - 1) >> shift;
+  const int height = (min_int (VIEW_TILE_SIZE, state->view_tiles_height - y) + (1 << shift) - 1) >> shift;
+  cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+  cairo_t *cr = cairo_create (surface);
+
+  cairo_scale (cr, 1.0 / (1 << shift), 1.0 / (1 << shift));
+  cairo_translate (cr, -x, -y);
+  draw_layers (state, cr);
+  cairo_destroy (cr);
+  cairo_surface_flush (surface);
+
+  // Premultiplied native-endian ARGB32 is what GDK_MEMORY_DEFAULT means, so
+  // the texture takes the pixels as they are.
+  const int stride = cairo_image_surface_get_stride (surface);
+  GBytes *bytes = g_bytes_new_with_free_func (cairo_image_surface_get_data (surface), (gsize) stride * height, (GDestroyNotify) cairo_surface_destroy, surface);
+  GdkTexture *texture = gdk_memory_texture_new (width, height, GDK_MEMORY_DEFAULT, bytes, stride);
+  g_bytes_unref (bytes);
+  return texture;
+}
+
+static void
+view_snapshot_background (GtkSnapshot *snapshot, const graphene_rect_t *bounds, double zoom)
+{
+  const float dark = GPAINT_TRANSPARENT_FIRST_COLOR;
+  const float light = GPAINT_TRANSPARENT_SECOND_COLOR;
+  const float middle = (dark + light) / 2.0f;
+
+  if (zoom <= 4.0)
+    {
+      gtk_snapshot_append_color (snapshot, &(GdkRGBA) { middle, middle, middle, 1.0f }, bounds);
+      return;
+    }
+
+  const float cell = gpaint_checkerboard_cell (zoom);
+
+  gtk_snapshot_push_repeat (snapshot, bounds, &GRAPHENE_RECT_INIT (0.0f, 0.0f, 2.0f * cell, 2.0f * cell));
+  gtk_snapshot_append_color (snapshot, &(GdkRGBA) { light, light, light, 1.0f }, &GRAPHENE_RECT_INIT (0.0f, 0.0f, 2.0f * cell, 2.0f * cell));
+  gtk_snapshot_append_color (snapshot, &(GdkRGBA) { dark, dark, dark, 1.0f }, &GRAPHENE_RECT_INIT (0.0f, 0.0f, cell, cell));
+  gtk_snapshot_append_color (snapshot, &(GdkRGBA) { dark, dark, dark, 1.0f }, &GRAPHENE_RECT_INIT (cell, cell, cell, cell));
+  gtk_snapshot_pop (snapshot);
+}
+
+static void
+view_snapshot_grid (GtkSnapshot *snapshot, const GdkRectangle *pixels, double zoom)
+{
+  const float shade = (GPAINT_TRANSPARENT_FIRST_COLOR + GPAINT_TRANSPARENT_SECOND_COLOR) / 2.0;
+  const GdkRGBA color = { shade, shade, shade, 1.0f };
+  const float size = zoom;
+
+  // One cell of the grid, starting half a line before its grid lines.
+  gtk_snapshot_push_repeat (snapshot,
+                            &GRAPHENE_RECT_INIT (pixels->x * size - 0.5f, pixels->y * size - 0.5f, pixels->width * size + 1.0f, pixels->height * size + 1.0f),
+                            &GRAPHENE_RECT_INIT (-0.5f, -0.5f, size, size));
+  gtk_snapshot_append_color (snapshot, &color, &GRAPHENE_RECT_INIT (-0.5f, -0.5f, 1.0f, size));
+  gtk_snapshot_append_color (snapshot, &color, &GRAPHENE_RECT_INIT (-0.5f, -0.5f, size, 1.0f));
+  gtk_snapshot_pop (snapshot);
+}
+
+// Adds the canvas to snapshot: the background, the tiles composited by
+// draw_layers and the grid.
+void
+view_snapshot (AppState *state, GtkSnapshot *snapshot, ViewDrawFunc draw_layers)
+{
+  const double zoom = state->zoom_level;
+  const int width = cairo_image_surface_get_width (state->main_surface);
+  const int height = cairo_image_surface_get_height (state->main_surface);
+  GdkRectangle area;
+
+  view_get_area (state, &area);
+
+  if (area.width <= 0 || area.height <= 0)
+    return;
+
+  // Zoomed out, tiles are composited from the mipmap at the resolution they
+  // are shown at.
+  if (state->view_tiles_width != width || state->view_tiles_height != height || state->view_tiles_level != mipmap_level (zoom))
+    {
+      view_free_tiles (state);
+      state->view_tiles_level = mipmap_level (zoom);
+      state->view_tiles = g_new0 (GdkTexture *, view_tile_count (width) * view_tile_count (height));
+      state->view_tiles_width = width;
+      state->view_tiles_height = height;
+    }
+
+  view_track_selection (state);
+
+  gint64 start = frame_stats_now (state->frame_stats);
+  view_snapshot_background (snapshot, &GRAPHENE_RECT_INIT (area.x, area.y, area.width, area.height), zoom);
+  frame_stats_add (state->frame_stats, FRAME_STAGE_BACKGROUND, start);
+
+  // Canvas pixels under the visible area.
+  const int left = max_int ((int) floor (area.x / zoom), 0);
+  const int top = max_int ((int) floor (area.y / zoom), 0);
+  const int right = min_int ((int) ceil ((area.x + area.width) / zoom), width);
+  const int bottom = min_int ((int) ceil ((area.y + area.height) / zoom), height);
+
+  if (left >= right || top >= bottom)
+    return;
+
+  const int columns = view_tile_count (width);
+
+  for (int row = top / VIEW_TILE_SIZE; row < view_tile_count (bottom); row++)
+    for (int column = left / VIEW_TILE_SIZE; column < view_tile_count (right); column++)
+      {
+        GdkTexture **tile = &state->view_tiles[row * columns + column];
+
+        if (!*tile)
+          *tile = view_create_tile (state, column, row, draw_layers);
+
+        const int x = column * VIEW_TILE_SIZE;
+        const int y = row * VIEW_TILE_SIZE;
+
+        gtk_snapshot_append_scaled_texture (snapshot, *tile, GSK_SCALING_FILTER_NEAREST,
+                                            &GRAPHENE_RECT_INIT (x * zoom, y * zoom,
+                                                                 min_int (VIEW_TILE_SIZE, width - x) * zoom,
+                                                                 min_int (VIEW_TILE_SIZE, height - y) * zoom));
+      }
+
+  if (g_variant_get_boolean (g_action_get_state (state->show_grid_action)) && zoom >= 4.0)
+    {
+      start = frame_stats_now (state->frame_stats);
+      view_snapshot_grid (snapshot, &(GdkRectangle) { left, top, right - left, bottom - top }, zoom);
+      frame_stats_add (state->frame_stats, FRAME_STAGE_GRID, start);
+    }
+}
+#endif
+
+void
+free_view (AppState *state)
+{
+  view_free_tiles (state);
+  g_clear_pointer (&state->view_surface, cairo_surface_destroy);
+  g_clear_pointer (&state->view_damage, cairo_region_destroy);
+}
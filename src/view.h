@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cairo.h>
+#include <glib.h>
+
+#include "gpaint.h"
+
+typedef void (*ViewDrawFunc) (AppState *state, cairo_t *cr);
+
+extern void view_invalidate (AppState *state, const GdkRectangle *rect);
+extern void view_draw (AppState *state, cairo_t *cr, ViewDrawFunc draw_canvas);
+#if GTK_CHECK_VERSION (4, 10, 0)
+extern void view_snapshot (AppState *state, GtkSnapshot *snapshot, ViewDrawFunc draw_layers);
+#endif
+extern void free_view (AppState *state);
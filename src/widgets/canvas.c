@@ -0,0 +1,50 @@
+#include "canvas.h"
+
+// A drawing area which lets its owner add render nodes below the cairo
+// drawing, so content kept in textures is not drawn with cairo every frame.
+struct _GpaintCanvas
+{
+  GtkDrawingArea parent_instance;
+  GpaintCanvasSnapshotFunc snapshot_func;
+  gpointer user_data;
+};
+
+G_DEFINE_TYPE (GpaintCanvas, gpaint_canvas, GTK_TYPE_DRAWING_AREA);
+
+static void
+gpaint_canvas_snapshot (GtkWidget *widget, GtkSnapshot *snapshot)
+{
+  GpaintCanvas *self = GPAINT_CANVAS (widget);
+
+  if (self->snapshot_func)
+    self->snapshot_func (self, snapshot, self->user_data);
+
+  GTK_WIDGET_CLASS (gpaint_canvas_parent_class)->snapshot (widget, snapshot);
+}
+
+static void
+gpaint_canvas_init (GpaintCanvas *self)
+{
+  return;
+}
+
+static void
+gpaint_canvas_class_init (GpaintCanvasClass *klass)
+{
+  GTK_WIDGET_CLASS (klass)->snapshot = gpaint_canvas_snapshot;
+}
+
+GtkWidget *
+gpaint_canvas_new (void)
+{
+  return GTK_WIDGET (g_object_new (GPAINT_TYPE_CANVAS, NULL));
+}
+
+// Sets the function adding the nodes drawn below the draw function.
+void
+gpaint_canvas_set_snapshot_func (GpaintCanvas *self, GpaintCanvasSnapshotFunc snapshot_func, gpointer user_data)
+{
+  self->snapshot_func = snapshot_func;
+  self->user_data = user_data;
+  gtk_widget_queue_draw (GTK_WIDGET (self));
+}
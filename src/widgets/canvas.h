@@ -0,0 +1,15 @@
+#pragma once
+
+#include <gtk/gtk.h>
+
+G_BEGIN_DECLS
+
+#define GPAINT_TYPE_CANVAS (gpaint_canvas_get_type ())
+G_DECLARE_FINAL_TYPE (GpaintCanvas, gpaint_canvas, GPAINT, CANVAS, GtkDrawingArea);
+
+typedef void (*GpaintCanvasSnapshotFunc) (GpaintCanvas *canvas, GtkSnapshot *snapshot, gpointer user_data);
+
+extern GtkWidget *gpaint_canvas_new (void);
+extern void gpaint_canvas_set_snapshot_func (GpaintCanvas *self, GpaintCanvasSnapshotFunc snapshot_func, gpointer user_data);
+
+G_END_DECLS
@@ -102,7 +102,7 @@ gpaint_color_swap_button_update_colors (GpaintColorSwapButton *self)
 static void
 draw_color (cairo_t *cr, gint width, gint height, const GdkRGBA *color)
 {
-  draw_colored_square (cr, color, 0, 0, width, height, 12.0);
+  draw_colored_square (cr, color, 0, 0, width, height);
   const GdkRGBA border = { 0.2, 0.2, 0.2, 1.0 };
   const gdouble border_width = 1.0;
   cairo_save (cr);